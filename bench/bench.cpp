@@ -0,0 +1,617 @@
+// Benchmarks for the shell's hot paths. Every benchmark runs a fixed number of
+// iterations against fixtures generated in a temporary directory, and reports
+// the median, p90 and minimum per-iteration time, so numbers are comparable
+// between runs and between commits.
+//
+//   shell_bench            run everything
+//   shell_bench lookup     run benchmarks whose name contains "lookup"
+
+#include <bits/stdc++.h>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+#include "../shell.h"
+using namespace std;
+
+static FILE *report = stdout;
+static string filter;
+static filesystem::path fixture_root;
+
+static double now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static bool selected(const string &name)
+{
+  return filter.empty() || name.find(filter) != string::npos;
+}
+
+// Whether any benchmark named "<group>..." can match the filter; used to skip
+// expensive fixtures.
+static bool group_selected(const string &group)
+{
+  return filter.empty() || group.find(filter) != string::npos || filter.compare(0, group.size(), group) == 0;
+}
+
+// Times `iterations` calls of fn. `units` is the amount of work one call does
+// (bytes, commands, ...) and `unit` its name; when set, a throughput column is
+// printed as well.
+template <class F>
+void bench(const string &name, int iterations, F &&fn, double units = 0, const char *unit = nullptr)
+{
+  if (!selected(name))
+    return;
+  fn(); // warm-up
+  vector<double> samples;
+  samples.reserve(iterations);
+  for (int i = 0; i < iterations; i++)
+  {
+    double start = now_us();
+    fn();
+    samples.push_back(now_us() - start);
+  }
+  sort(samples.begin(), samples.end());
+  double median = samples[samples.size() / 2];
+  double p90 = samples[min(samples.size() - 1, samples.size() * 9 / 10)];
+  fprintf(report, "%-44s %7d  median %11.2f us  p90 %11.2f us  min %11.2f us", name.c_str(), iterations, median, p90, samples.front());
+  if (unit)
+    fprintf(report, "  %12.1f %s/s", units / (median / 1e6), unit);
+  fputc('\n', report);
+  fflush(report);
+}
+
+static void run(const string &line)
+{
+  int exit_code = 0;
+  execute_line(line, exit_code);
+}
+
+static void make_executables(const filesystem::path &dir, int count, const string &prefix)
+{
+  filesystem::create_directories(dir);
+  for (int i = 0; i < count; i++)
+  {
+    string path = (dir / (prefix + to_string(i))).string();
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd >= 0)
+      close(fd);
+  }
+}
+
+// The tokenizer and word copying that preceded lex_command_line, kept here as
+// the baseline for the tokenize benchmarks.
+static vector<string> legacy_parse_command_line(const string &line)
+{
+  vector<string> tokens;
+  string current;
+  bool single_quote = false;
+  bool double_quote = false;
+  bool escape_next = false;
+  for (size_t i = 0; i < line.size(); ++i)
+  {
+    char ch = line[i];
+    if (escape_next)
+    {
+      current.push_back(ch);
+      escape_next = false;
+    }
+    else if (!single_quote && !double_quote && ch == '\\')
+    {
+      escape_next = true;
+    }
+    else if (double_quote && ch == '\\')
+    {
+      if (i + 1 < line.size() && (line[i + 1] == '"' || line[i + 1] == '\\'))
+      {
+        current.push_back(line[i + 1]);
+        i++;
+      }
+      else
+      {
+        current.push_back('\\');
+      }
+    }
+    else if (ch == '\'' && !double_quote)
+    {
+      single_quote = !single_quote;
+    }
+    else if (ch == '"' && !single_quote)
+    {
+      double_quote = !double_quote;
+    }
+    else if (!single_quote && !double_quote && (ch == ' ' || ch == '\t'))
+    {
+      if (!current.empty())
+      {
+        tokens.push_back(current);
+        current.clear();
+      }
+    }
+    else
+    {
+      current.push_back(ch);
+    }
+  }
+  if (escape_next)
+  {
+    current.push_back('\\');
+  }
+  if (!current.empty())
+  {
+    tokens.push_back(current);
+  }
+  return tokens;
+}
+
+static size_t legacy_parse_and_split(const string &line)
+{
+  vector<string> tokens = legacy_parse_command_line(line);
+  vector<vector<string>> pipeline;
+  vector<string> current;
+  for (const auto &tok : tokens)
+  {
+    if (tok == "|")
+    {
+      pipeline.push_back(current);
+      current.clear();
+    }
+    else
+    {
+      current.push_back(tok);
+    }
+  }
+  pipeline.push_back(current);
+  vector<string> arguments(pipeline[0].begin() + 1, pipeline[0].end());
+  vector<string> clean_args;
+  for (size_t i = 0; i < arguments.size(); ++i)
+  {
+    if ((arguments[i] == ">" || arguments[i] == ">>") && i + 1 < arguments.size())
+      i++;
+    else
+      clean_args.push_back(arguments[i]);
+  }
+  return pipeline.size() + clean_args.size();
+}
+
+static void bench_tokenize()
+{
+  string line;
+  for (int i = 0; i < 200; i++)
+  {
+    line += "word" + to_string(i) + " \"double quoted " + to_string(i) + "\" 'single' esc\\ aped ";
+    if (i % 50 == 49)
+      line += "| ";
+  }
+  line += "> out.txt";
+  double bytes = line.size();
+
+  vector<char> arena;
+  string error;
+  bench("tokenize/lex+parse (long line)", 2000, [&]()
+        { parse_command_line(line, arena, error); }, bytes, "B");
+  bench("tokenize/legacy (long line)", 2000, [&]()
+        { legacy_parse_and_split(line); }, bytes, "B");
+
+  string short_line = "grep -F \"needle\" file.txt | sort | uniq -c > counts.txt";
+  bench("tokenize/lex+parse (short line)", 20000, [&]()
+        { parse_command_line(short_line, arena, error); }, short_line.size(), "B");
+  bench("tokenize/legacy (short line)", 20000, [&]()
+        { legacy_parse_and_split(short_line); }, short_line.size(), "B");
+
+  set_variable("BENCH_DIR", "/var/tmp/shell-bench");
+  string expanding = "cp \"$BENCH_DIR/in.txt\" ${BENCH_DIR}/out.txt $HOME/x | grep -F $BENCH_DIR";
+  bench("tokenize/lex+parse (4 expansions)", 20000, [&]()
+        { parse_command_line(expanding, arena, error); }, expanding.size(), "B");
+}
+
+static void bench_lookup()
+{
+  // 20 PATH directories of 300 executables each; the target lives in the last.
+  string path_env;
+  for (int d = 0; d < 20; d++)
+  {
+    filesystem::path dir = fixture_root / "path" / ("d" + to_string(d));
+    make_executables(dir, 300, "cmd" + to_string(d) + "_");
+    path_env += (d ? ":" : "") + dir.string();
+  }
+  string saved = variable_value("PATH") ? variable_value("PATH") : "";
+  set_variable("PATH", path_env);
+
+  bench("lookup/cold (20 dirs, hit in last)", 2000, []()
+        {
+    hash_reset();
+    find_in_path("cmd19_150"); });
+  bench("lookup/hashed (20 dirs, hit in last)", 20000, []()
+        { find_in_path("cmd19_150"); });
+  bench("lookup/miss (20 dirs)", 2000, []()
+        { find_in_path("no_such_command"); });
+
+  set_variable("PATH", saved);
+}
+
+static void bench_completion()
+{
+  filesystem::path dir = fixture_root / "completion";
+  make_executables(dir, 6000, "tool");
+  string saved = variable_value("PATH") ? variable_value("PATH") : "";
+  string path_a = dir.string();
+  string path_b = dir.string() + ":";
+
+  // Flipping between two spellings of the same PATH forces a full rebuild,
+  // as in a newly started shell: from the on-disk snapshot, or by scanning.
+  bool flip = false;
+  string snapshot = variable_value("SHELL_PATH_INDEX");
+  bench("completion/first Tab (6000 executables, snapshot)", 50, [&]()
+        {
+    flip = !flip;
+    set_variable("PATH", flip ? path_a : path_b);
+    completion_matches("tool12"); });
+  set_variable("SHELL_PATH_INDEX", "");
+  bench("completion/first Tab (6000 executables, scan)", 50, [&]()
+        {
+    flip = !flip;
+    set_variable("PATH", flip ? path_a : path_b);
+    completion_matches("tool12"); });
+  set_variable("SHELL_PATH_INDEX", snapshot);
+  bench("completion/query (6000 executables)", 20000, []()
+        { completion_matches("tool12"); });
+  bench("completion/query all (6000 executables)", 2000, []()
+        { completion_matches("tool"); });
+
+  set_variable("PATH", saved);
+
+  if (!group_selected("completion/files"))
+    return;
+  filesystem::path files = fixture_root / "files";
+  filesystem::create_directories(files);
+  for (int i = 0; i < 100000; i++)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "file%06d", i);
+    close(open((files / name).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+  }
+  // Backdated mtimes: each new one forces a rescan, and listings of
+  // directories changed within the last second are never reused.
+  time_t stamp = time(nullptr) - 3600;
+  auto backdate = [&]()
+  {
+    struct timespec times[2] = {{stamp, 0}, {stamp, 0}};
+    stamp++;
+    utimensat(AT_FDCWD, files.c_str(), times, 0);
+  };
+  string word = files.string() + "/file0999";
+  bench("completion/files first Tab (100k files, scan)", 20, [&]()
+        {
+    backdate();
+    filename_matches(word); });
+  bench("completion/files query (100k files, cached)", 20000, [&]()
+        { filename_matches(word); });
+  bench("completion/files query all (100k files, cached)", 50, [&]()
+        { filename_matches(files.string() + "/"); });
+}
+
+static void bench_spawn()
+{
+  bench("spawn/true", 500, []()
+        { run("true"); });
+
+  // Spawn latency against the size of the shell's heap: posix_spawn and the
+  // spawn helper should stay flat while the fork baseline grows with the
+  // history.
+  for (int entries : {0, 100000, 500000})
+  {
+    clear_history();
+    for (int i = 0; i < entries; i++)
+    {
+      add_history(("echo history entry number " + to_string(i)).c_str());
+    }
+    string suffix = " (history " + to_string(entries) + ")";
+    bench("spawn/posix_spawn" + suffix, 300, []()
+          { run("true"); });
+    use_spawn_helper(true);
+    bench("spawn/helper" + suffix, 300, []()
+          { run("true"); });
+    use_spawn_helper(false);
+    bench("spawn/fork+exec baseline" + suffix, 300, []()
+          {
+      pid_t pid = fork();
+      if (pid == 0)
+      {
+        execl("/bin/true", "true", (char *)nullptr);
+        _exit(127);
+      }
+      waitpid(pid, nullptr, 0); });
+  }
+  clear_history();
+}
+
+static void bench_pipeline()
+{
+  for (int stages : {2, 4, 8})
+  {
+    string line = "true";
+    for (int i = 1; i < stages; i++)
+    {
+      line += " | true";
+    }
+    bench("pipeline/" + to_string(stages) + " stages of true", 200, [&]()
+          { run(line); });
+  }
+
+  filesystem::path data = fixture_root / "data.bin";
+  {
+    ofstream out(data, ios::binary);
+    string block(1 << 20, 'x');
+    for (int i = 0; i < 64; i++)
+    {
+      out << block;
+    }
+  }
+  double bytes = 64.0 * (1 << 20);
+  for (int stages : {1, 3})
+  {
+    string line = "cat " + data.string();
+    for (int i = 0; i < stages; i++)
+    {
+      line += " | cat";
+    }
+    line += " > /dev/null";
+    bench("pipeline/64 MiB through " + to_string(stages) + " cat", 10, [&]()
+          { run(line); }, bytes, "B");
+  }
+
+  // Stage placement on a pipeline of real processes: pinned to neighbouring
+  // cores against left to the scheduler. Needs more than one CPU to differ.
+  set_variable("SHELL_FILTERS", "0");
+  string heavy = "cat " + data.string() + " | tr x y | cat | wc -c";
+  for (bool pinned : {false, true})
+  {
+    set_variable("SHELL_PIPELINE_AFFINITY", pinned ? "1" : "0");
+    bench(string("pipeline/64 MiB cat|tr|cat|wc") + (pinned ? " (pinned)" : " (unpinned)"), 10, [&]()
+          { run(heavy); }, bytes, "B");
+  }
+  unset_variable("SHELL_PIPELINE_AFFINITY");
+
+  // Pipe capacity on the same pipeline; adaptive runs learn from the runs
+  // before them.
+  for (const char *size : {"64k", "1M", "adaptive"})
+  {
+    set_variable("SHELL_PIPE_SIZE", size);
+    bench(string("pipeline/64 MiB cat|tr|cat|wc pipe=") + size, 10, [&]()
+          { run(heavy); }, bytes, "B");
+  }
+  unset_variable("SHELL_PIPE_SIZE");
+  unset_variable("SHELL_FILTERS");
+}
+
+static void bench_filters()
+{
+  if (!group_selected("filters/"))
+    return;
+  filesystem::path data = fixture_root / "lines.txt";
+  {
+    ofstream out(data);
+    for (int i = 0; i < 1000000; i++)
+    {
+      out << "2024-01-01 12:00:00 INFO request " << i << " served in " << i % 977 << " ms\n";
+    }
+  }
+  double bytes = filesystem::file_size(data);
+  string file = data.string();
+  struct Case
+  {
+    const char *name;
+    string line;
+  };
+  vector<Case> cases = {
+      {"cat | grep -F | wc -l", "cat " + file + " | grep -F 'in 97' | wc -l"},
+      {"grep -F", "grep -F 'in 97' " + file},
+      {"wc -l", "wc -l " + file},
+      {"cat | head", "cat " + file + " | head -n 5"},
+  };
+  // Into a file rather than /dev/null, which GNU grep short-circuits.
+  string sink = " > " + (fixture_root / "filters_out.txt").string();
+  for (const auto &c : cases)
+  {
+    unset_variable("SHELL_FILTERS");
+    bench(string("filters/") + c.name + " (in shell)", 10, [&]()
+          { run(c.line + sink); }, bytes, "B");
+    set_variable("SHELL_FILTERS", "0");
+    bench(string("filters/") + c.name + " (processes)", 10, [&]()
+          { run(c.line + sink); }, bytes, "B");
+  }
+  unset_variable("SHELL_FILTERS");
+}
+
+// A 2000-directory tree of 40k files, expanded by the shell's glob engine
+// and, for contrast, listed by a find process.
+static void bench_glob()
+{
+  if (!group_selected("glob/"))
+    return;
+  filesystem::path tree = fixture_root / "tree";
+  for (int a = 0; a < 40; a++)
+  {
+    for (int b = 0; b < 50; b++)
+    {
+      filesystem::path dir = tree / ("d" + to_string(a)) / ("e" + to_string(b));
+      filesystem::create_directories(dir);
+      for (int f = 0; f < 20; f++)
+      {
+        close(open((dir / ("f" + to_string(f) + ".txt")).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+      }
+    }
+  }
+  string root = tree.string();
+  bench("glob/*/*/*.txt (40k matches)", 10, [&]()
+        { glob_paths(root + "/*/*/*.txt"); });
+  bench("glob/**/*.txt (40k matches)", 10, [&]()
+        { glob_paths(root + "/**/*.txt"); });
+  bench("glob/echo **/*.txt (in shell)", 10, [&]()
+        { run("echo " + root + "/**/*.txt"); });
+  bench("glob/find -name (process)", 10, [&]()
+        { run("find " + root + " -name '*.txt'"); });
+}
+
+// Loads a 500k-entry history (the store behind `history`) for the history
+// benchmarks; generated once and shared by them.
+static void load_large_history()
+{
+  static bool loaded = false;
+  if (loaded)
+    return;
+  loaded = true;
+  filesystem::path file = fixture_root / "history.txt";
+  {
+    ofstream out(file);
+    for (int i = 0; i < 500000; i++)
+    {
+      out << "git commit -m 'change number " << i << "' --author=user" << i % 97 << "\n";
+    }
+  }
+  // Loaded as HISTFILE, so searches run over the mapped log.
+  set_variable("HISTFILE", file.string());
+  load_history_file();
+  unset_variable("HISTFILE");
+}
+
+static void bench_history()
+{
+  if (!group_selected("history/"))
+    return;
+  load_large_history();
+  bench("history/search substring (500k entries)", 20, []()
+        { run("history -s number 4242"); });
+  bench("history/search no match (500k entries)", 20, []()
+        { run("history -s zzzzzz"); });
+  bench("history/search fuzzy (500k entries)", 10, []()
+        { run("history -s 99999u"); });
+
+  string listing = "history > " + (fixture_root / "history_out.txt").string();
+  bench("history/list > file (500k entries)", 10, [&]()
+        { run(listing); });
+  bench("history/list | cat (500k entries)", 10, []()
+        { run("history | cat > /dev/null"); });
+}
+
+static void bench_builtin_output()
+{
+  string line = "echo";
+  for (int i = 0; i < 1000; i++)
+  {
+    line += " argument" + to_string(i);
+  }
+  bench("builtin/echo 1000 args > /dev/null", 500, [&]()
+        { run(line + " > /dev/null"); });
+  bench("builtin/echo 1000 args | cat", 200, [&]()
+        { run(line + " | cat"); });
+}
+
+static void bench_here()
+{
+  // 1 MiB of input delivered as a here-document (a memfd), against writing
+  // the same bytes to a temporary file and redirecting it with <.
+  string body;
+  for (int i = 0; body.size() < (1 << 20); i++)
+  {
+    body += "payload line " + to_string(i) + "\n";
+  }
+  string heredoc = "wc -c <<'EOF'\n" + body + "EOF";
+  filesystem::path file = fixture_root / "here.txt";
+  double bytes = body.size();
+  bench("here/1 MiB here-document (memfd)", 50, [&]()
+        { run(heredoc); }, bytes, "B");
+  bench("here/1 MiB temp file and <", 50, [&]()
+        {
+    {
+      ofstream out(file);
+      out << body;
+    }
+    run("wc -c < " + file.string()); }, bytes, "B");
+  bench("here/here-string (pipe)", 500, []()
+        { run("wc -c <<< hello"); });
+}
+
+static void bench_batch()
+{
+  const int lines = 10000;
+  filesystem::path script = fixture_root / "batch.sh";
+  {
+    ofstream out(script);
+    for (int i = 0; i < lines; i++)
+    {
+      out << "echo line " << i << "\n";
+    }
+  }
+  bench("batch/10000 builtin lines", 10, [&]()
+        {
+    int fd = open(script.c_str(), O_RDONLY | O_CLOEXEC);
+    run_batch(fd);
+    close(fd); }, lines, "cmd");
+
+  const int external_lines = 200;
+  filesystem::path external = fixture_root / "batch_external.sh";
+  {
+    ofstream out(external);
+    for (int i = 0; i < external_lines; i++)
+    {
+      out << "true\n";
+    }
+  }
+  bench("batch/200 external lines", 5, [&]()
+        {
+    int fd = open(external.c_str(), O_RDONLY | O_CLOEXEC);
+    run_batch(fd);
+    close(fd); }, external_lines, "cmd");
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc > 1)
+    filter = argv[1];
+  shell_init();
+  // Forked while the bench is small, as the interactive shell does; only the
+  // spawn/helper cases route through it.
+  start_spawn_helper();
+  use_spawn_helper(false);
+
+  // Results go to the original stdout; everything the benchmarked commands
+  // print goes to /dev/null.
+  report = fdopen(dup(STDOUT_FILENO), "w");
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+
+  char tmpl[] = "/tmp/shell_bench.XXXXXX";
+  if (!mkdtemp(tmpl))
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+  fixture_root = tmpl;
+  // Keep the PATH index snapshot out of the user's cache.
+  set_variable("SHELL_PATH_INDEX", (fixture_root / "path-index").string());
+
+  bench_tokenize();
+  bench_lookup();
+  bench_completion();
+  bench_spawn();
+  bench_pipeline();
+  bench_filters();
+  bench_glob();
+  bench_history();
+  bench_builtin_output();
+  bench_here();
+  bench_batch();
+
+  error_code e;
+  filesystem::remove_all(fixture_root, e);
+  return 0;
+}
@@ -0,0 +1,6222 @@
+#include <bits/stdc++.h>
+#include <filesystem>
+#include <optional>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <signal.h>
+#include <climits>
+#include <poll.h>
+#include <sched.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// Gives rl_message its variadic prototype.
+#define USE_VARARGS
+#define PREFER_STDARG
+#include <readline/readline.h>
+#include <readline/history.h>
+#include "shell.h"
+using namespace std;
+
+#ifdef _WIN32
+constexpr char PATH_SEPARATOR = ';';
+#else
+constexpr char PATH_SEPARATOR = ':';
+#endif
+
+static vector<string> builtins = {"echo", "exit", "type", "pwd", "cd", "history", "hash", "tee", "jobs", "fg", "bg", "wait", "cache",
+                                  "export", "unset"};
+static bool tab_pressed_once = false;
+static string last_completion_prefix;
+static vector<string> last_matches;
+static int last_history_written = 0;
+
+// Opt-in latency tracing; see TraceScope in shell.h.
+bool trace_enabled = false;
+static FILE *trace_file = nullptr;
+static bool trace_first_event = true;
+static mutex trace_mutex;
+
+static double trace_now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static string json_escape(string_view text)
+{
+  string out;
+  for (char ch : text)
+  {
+    if (ch == '"' || ch == '\\')
+    {
+      out.push_back('\\');
+      out.push_back(ch);
+    }
+    else if ((unsigned char)ch < 0x20)
+    {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", ch);
+      out += buf;
+    }
+    else
+    {
+      out.push_back(ch);
+    }
+  }
+  return out;
+}
+
+void trace_close()
+{
+  if (!trace_file)
+    return;
+  lock_guard<mutex> lock(trace_mutex);
+  fputs("\n]\n", trace_file);
+  fclose(trace_file);
+  trace_file = nullptr;
+  trace_enabled = false;
+}
+
+void trace_open()
+{
+  const char *path = getenv("SHELL_TRACE");
+  if (!path || !*path)
+    return;
+  trace_file = fopen(path, "we");
+  if (!trace_file)
+  {
+    perror("SHELL_TRACE");
+    return;
+  }
+  fputs("[\n", trace_file);
+  trace_enabled = true;
+  atexit(trace_close);
+}
+
+void TraceScope::begin(const char *name, string_view detail)
+{
+  active = true;
+  this->name = name;
+  this->detail = detail;
+  start = trace_now_us();
+}
+
+void TraceScope::finish()
+{
+  double end = trace_now_us();
+  lock_guard<mutex> lock(trace_mutex);
+  if (!trace_file)
+    return;
+  fprintf(trace_file, "%s{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+          trace_first_event ? "" : ",\n", name, start, end - start, (int)getpid(), (int)gettid());
+  if (!detail.empty())
+    fprintf(trace_file, ",\"args\":{\"detail\":\"%s\"}", json_escape(detail).c_str());
+  fputs("}", trace_file);
+  trace_first_event = false;
+}
+
+// argv entries must be NUL-terminated views; the lexer's arena guarantees it.
+vector<char *> to_char_ptr_vec(const vector<string_view> &argv)
+{
+  vector<char *> result;
+  result.reserve(argv.size() + 1);
+  for (const auto &arg : argv)
+  {
+    result.push_back(const_cast<char *>(arg.data()));
+  }
+  result.push_back(nullptr);
+  return result;
+}
+
+vector<string> split_path(const string &path_env)
+{
+  vector<string> dirs;
+  string dir;
+  for (char ch : path_env)
+  {
+    if (ch != PATH_SEPARATOR)
+    {
+      dir.push_back(ch);
+    }
+    else
+    {
+      dirs.push_back(dir);
+      dir.clear();
+    }
+  }
+  if (!dir.empty())
+    dirs.push_back(dir);
+  return dirs;
+}
+
+// Shell variables. Names are interned: each gets a record, never moved or
+// freed, holding its "NAME=value" string, so the value is a suffix of it and
+// an exported variable's record is also its environment entry. envp points at
+// those entries and is rebuilt only after an exported variable changes. The
+// store is filled from the process environment at startup and is the only
+// source of variables afterwards.
+struct Variable
+{
+  string entry; // "NAME=value"
+  size_t name_len = 0;
+  bool set = false;
+  bool exported = false;
+  uint64_t version = 0; // bumped on every change
+};
+
+static deque<Variable> variables;
+static unordered_map<string, size_t> variable_ids;
+static uint64_t variable_changes = 0;
+static vector<char *> envp_cache;
+static bool envp_stale = true;
+static uint64_t envp_builds = 0;
+static int last_status = 0; // $?
+
+static Variable &intern_variable(string_view name)
+{
+  auto it = variable_ids.find(string(name));
+  if (it != variable_ids.end())
+    return variables[it->second];
+  variable_ids.emplace(string(name), variables.size());
+  Variable &v = variables.emplace_back();
+  v.entry.assign(name).push_back('=');
+  v.name_len = name.size();
+  return v;
+}
+
+static const char *value_of(const Variable &v)
+{
+  return v.set ? v.entry.c_str() + v.name_len + 1 : nullptr;
+}
+
+const char *variable_value(string_view name)
+{
+  auto it = variable_ids.find(string(name));
+  return it == variable_ids.end() ? nullptr : value_of(variables[it->second]);
+}
+
+void set_variable(string_view name, string_view value, bool exported)
+{
+  Variable &v = intern_variable(name);
+  v.entry.resize(v.name_len + 1);
+  v.entry.append(value);
+  v.set = true;
+  v.exported = v.exported || exported;
+  v.version = ++variable_changes;
+  envp_stale = envp_stale || v.exported;
+}
+
+void unset_variable(string_view name)
+{
+  Variable &v = intern_variable(name);
+  envp_stale = envp_stale || (v.set && v.exported);
+  v.entry.resize(v.name_len + 1);
+  v.set = false;
+  v.exported = false;
+  v.version = ++variable_changes;
+}
+
+static void export_variable(string_view name)
+{
+  Variable &v = intern_variable(name);
+  envp_stale = envp_stale || (v.set && !v.exported);
+  v.exported = true;
+}
+
+static char *const *shell_envp()
+{
+  if (envp_stale)
+  {
+    envp_cache.clear();
+    for (auto &v : variables)
+    {
+      if (v.set && v.exported)
+        envp_cache.push_back(v.entry.data());
+    }
+    envp_cache.push_back(nullptr);
+    envp_stale = false;
+    envp_builds++;
+  }
+  return envp_cache.data();
+}
+
+static void import_environment()
+{
+  for (char **e = environ; *e; e++)
+  {
+    const char *eq = strchr(*e, '=');
+    if (!eq || eq == *e || variable_value(string_view(*e, eq - *e)))
+      continue;
+    set_variable(string_view(*e, eq - *e), eq + 1, true);
+  }
+}
+
+static bool is_name_start(char ch)
+{
+  return isalpha((unsigned char)ch) || ch == '_';
+}
+
+static bool is_name_char(char ch)
+{
+  return isalnum((unsigned char)ch) || ch == '_';
+}
+
+// Reads the parameter ($NAME, ${NAME}, $? or $$) whose '$' is at text[i]:
+// leaves i on its last character and value on its value (nullptr if unset,
+// `number` holds $? and $$). False if no parameter starts there.
+static bool read_parameter(string_view text, size_t &i, string &number, const char *&value)
+{
+  size_t n = text.size();
+  size_t at = i + 1;
+  size_t last = at;
+  string_view name;
+  if (at < n && (text[at] == '?' || text[at] == '$'))
+  {
+    name = text.substr(at, 1);
+  }
+  else if (at < n && text[at] == '{')
+  {
+    last = text.find('}', at);
+    if (last == string_view::npos)
+      return false;
+    name = text.substr(at + 1, last - at - 1);
+  }
+  else
+  {
+    while (last < n && is_name_char(text[last]))
+    {
+      last++;
+    }
+    name = text.substr(at, last-- - at);
+  }
+  bool special = name == "?" || name == "$";
+  if (!special && (name.empty() || !is_name_start(name[0]) || !all_of(name.begin(), name.end(), is_name_char)))
+    return false;
+  i = last;
+  if (special)
+  {
+    number = to_string(name == "?" ? last_status : getpid());
+    value = number.c_str();
+  }
+  else
+  {
+    value = variable_value(name);
+  }
+  return true;
+}
+
+// NAME=value, as the leading words of a command.
+bool is_assignment(string_view word)
+{
+  size_t eq = word.find('=');
+  if (eq == string_view::npos || eq == 0 || !is_name_start(word[0]))
+    return false;
+  return all_of(word.begin(), word.begin() + eq, is_name_char);
+}
+
+// PATH is read on every lookup, so it is kept at hand.
+static const Variable &path_variable()
+{
+  static const Variable &path = intern_variable("PATH");
+  return path;
+}
+
+// Command hash table, in the spirit of bash's `hash`. Resolved paths are kept
+// per command name and reused until PATH itself changes or one of the PATH
+// directories searched up to the hit is modified (its mtime moves). Directory
+// mtimes are checked at most once per command line (see hash_epoch).
+struct HashedCommand
+{
+  string path;
+  size_t dir_index;
+  int hits;
+};
+
+struct HashedDir
+{
+  string name;
+  bool known = false;
+  struct timespec mtime = {};
+  unsigned long checked_epoch = 0;
+};
+
+static unordered_map<string, HashedCommand> command_hash;
+static vector<HashedDir> hashed_dirs;
+static string hashed_path_env;
+static uint64_t hashed_path_version = ~0ull;
+static bool hashed_path_valid = false;
+static unsigned long hash_epoch = 1;
+
+static bool read_dir_mtime(const string &dir, struct timespec &mtime)
+{
+  struct stat st;
+  if (stat(dir.empty() ? "." : dir.c_str(), &st) != 0)
+    return false;
+  mtime = st.st_mtim;
+  return true;
+}
+
+void hash_reset()
+{
+  command_hash.clear();
+  for (auto &d : hashed_dirs)
+  {
+    d.known = false;
+    d.checked_epoch = 0;
+  }
+}
+
+// Re-reads PATH and drops every cached entry if it has changed.
+static void hash_sync_path()
+{
+  const Variable &path = path_variable();
+  if (path.version == hashed_path_version)
+    return;
+  hashed_path_version = path.version;
+  const char *env_p = value_of(path);
+  if (hashed_path_valid == (env_p != nullptr) && (!env_p || hashed_path_env == env_p))
+    return;
+  hashed_path_valid = env_p != nullptr;
+  hashed_path_env = env_p ? env_p : "";
+  hashed_dirs.clear();
+  for (auto &dir : split_path(hashed_path_env))
+  {
+    HashedDir d;
+    d.name = dir;
+    hashed_dirs.push_back(d);
+  }
+  command_hash.clear();
+}
+
+// Returns false if the directory has changed since its mtime was recorded.
+// The first call for a directory just records the mtime.
+static bool hash_check_dir(HashedDir &d)
+{
+  if (d.known && d.checked_epoch == hash_epoch)
+    return true;
+  struct timespec now = {};
+  bool exists = read_dir_mtime(d.name, now);
+  bool same = exists == d.known && (!exists || (now.tv_sec == d.mtime.tv_sec && now.tv_nsec == d.mtime.tv_nsec));
+  bool first = d.checked_epoch == 0;
+  d.known = exists;
+  d.mtime = now;
+  d.checked_epoch = hash_epoch;
+  return first || same;
+}
+
+struct IndexSnapshot;
+static shared_ptr<const IndexSnapshot> index_get();
+static shared_ptr<const IndexSnapshot> index_peek();
+struct Snapshot;
+static const Snapshot *snapshot_peek();
+static optional<bool> snapshot_lookup(const Snapshot *snap, const string &dir, const string &cmd,
+                                      const struct timespec &mtime);
+static optional<bool> index_lookup(const IndexSnapshot *index, size_t dir_index, const string &dir,
+                                   const string &cmd, const struct timespec &mtime);
+
+static bool is_executable_file(const string &path)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return false;
+  return !S_ISDIR(st.st_mode) && (st.st_mode & S_IXUSR);
+}
+
+optional<string> find_in_path(const string &cmd, bool count_hit)
+{
+  TraceScope trace("lookup", cmd);
+  hash_sync_path();
+  if (!hashed_path_valid)
+    return nullopt;
+
+  auto it = command_hash.find(cmd);
+  if (it != command_hash.end())
+  {
+    bool fresh = true;
+    for (size_t i = 0; i <= it->second.dir_index && fresh; i++)
+    {
+      fresh = hash_check_dir(hashed_dirs[i]);
+    }
+    if (fresh)
+    {
+      if (count_hit)
+        it->second.hits++;
+      return it->second.path;
+    }
+    hash_reset();
+  }
+
+  // Directories the executable index covers are answered from its listings
+  // instead of a stat per candidate. A lookup never builds the index itself:
+  // listing all of PATH costs far more than probing up to the first hit.
+  // Without an index, the on-disk snapshot answers for the directories it
+  // still matches.
+  auto index = index_peek();
+  const Snapshot *snap = index ? nullptr : snapshot_peek();
+  for (size_t i = 0; i < hashed_dirs.size(); i++)
+  {
+    if (!hash_check_dir(hashed_dirs[i]))
+    {
+      // A directory changed under us; everything resolved through it may be stale.
+      hash_reset();
+      hash_check_dir(hashed_dirs[i]);
+    }
+    if (!hashed_dirs[i].known)
+      continue;
+    string full = (filesystem::path(hashed_dirs[i].name) / cmd).string();
+    optional<bool> listed = index ? index_lookup(index.get(), i, hashed_dirs[i].name, cmd, hashed_dirs[i].mtime)
+                                  : snapshot_lookup(snap, hashed_dirs[i].name, cmd, hashed_dirs[i].mtime);
+    if (listed ? *listed : is_executable_file(full))
+    {
+      command_hash[cmd] = {full, i, count_hit ? 1 : 0};
+      return full;
+    }
+  }
+  return nullopt;
+}
+
+int builtin_hash(const vector<string> &args, ostream &out)
+{
+  if (!args.empty() && args[0] == "-r")
+  {
+    hash_reset();
+    return 0;
+  }
+  if (!args.empty())
+  {
+    int status = 0;
+    for (const auto &name : args)
+    {
+      if (find(builtins.begin(), builtins.end(), name) != builtins.end())
+        continue;
+      if (!find_in_path(name, false))
+      {
+        out << "hash: " << name << ": not found\n";
+        status = 1;
+      }
+    }
+    return status;
+  }
+  hash_sync_path();
+  if (command_hash.empty())
+  {
+    out << "hash: hash table empty\n";
+    return 0;
+  }
+  vector<pair<string, const HashedCommand *>> entries;
+  for (const auto &kv : command_hash)
+  {
+    entries.emplace_back(kv.first, &kv.second);
+  }
+  sort(entries.begin(), entries.end(), [](const auto &a, const auto &b)
+       { return a.first < b.first; });
+  out << "hits\tcommand\n";
+  for (const auto &e : entries)
+  {
+    out << setw(4) << e.second->hits << "\t" << e.second->path << "\n";
+  }
+  return 0;
+}
+
+// Fan-out of one pipe to several sinks without passing the data through
+// userspace: every sink but the last gets its own staging pipe, filled with
+// tee(2) (which duplicates pipe buffers by reference) and emptied into the
+// sink with splice(2); the last sink is fed by splicing straight out of the
+// input, which consumes it. Sinks that cannot take splice (e.g. a terminal)
+// fall back to read/write, as does an input that is not a pipe.
+struct FanOutSink
+{
+  int fd;
+  int stage[2] = {-1, -1};
+  bool splice_ok = true;
+  bool alive = true;
+};
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t written = write(fd, data, len);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    data += written;
+    len -= written;
+  }
+  return true;
+}
+
+// Moves len bytes (len == 0: everything up to EOF) from pipe src to the sink.
+// Data for a sink that has gone away is read and dropped.
+static void fan_out_move(int src, FanOutSink &sink, size_t len)
+{
+  bool until_eof = len == 0;
+  char buf[65536];
+  while (until_eof || len > 0)
+  {
+    size_t want = until_eof ? (1 << 20) : len;
+    ssize_t moved;
+    if (sink.alive && sink.splice_ok)
+    {
+      moved = splice(src, nullptr, sink.fd, nullptr, want, SPLICE_F_MOVE);
+      if (moved < 0)
+      {
+        if (errno == EINVAL)
+          sink.splice_ok = false;
+        else if (errno != EINTR)
+          sink.alive = false;
+        continue;
+      }
+    }
+    else
+    {
+      moved = read(src, buf, min(want, sizeof(buf)));
+      if (moved < 0 && errno == EINTR)
+        continue;
+      if (moved > 0 && sink.alive && !write_all(sink.fd, buf, moved))
+        sink.alive = false;
+    }
+    if (moved <= 0)
+      break;
+    if (!until_eof)
+      len -= moved;
+  }
+}
+
+void fan_out(int in_fd, const vector<int> &sink_fds)
+{
+  if (sink_fds.empty())
+    return;
+  vector<FanOutSink> sinks;
+  for (int fd : sink_fds)
+  {
+    sinks.push_back({fd});
+  }
+
+  struct stat st;
+  if (fstat(in_fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+  {
+    char buf[65536];
+    while (true)
+    {
+      ssize_t got = read(in_fd, buf, sizeof(buf));
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= 0)
+        break;
+      bool any_alive = false;
+      for (auto &sink : sinks)
+      {
+        if (sink.alive && !write_all(sink.fd, buf, got))
+          sink.alive = false;
+        any_alive = any_alive || sink.alive;
+      }
+      if (!any_alive)
+        break;
+    }
+    return;
+  }
+
+  if (sinks.size() == 1)
+  {
+    fan_out_move(in_fd, sinks[0], 0);
+    return;
+  }
+
+  // Staging pipes get the input's capacity, so an empty one can always take a
+  // full tee of whatever the input holds.
+  int capacity = fcntl(in_fd, F_GETPIPE_SZ);
+  size_t staged = sinks.size() - 1;
+  for (size_t k = 0; k < staged; k++)
+  {
+    if (pipe2(sinks[k].stage, O_CLOEXEC) != 0)
+    {
+      perror("pipe");
+      for (size_t j = 0; j < k; j++)
+      {
+        close(sinks[j].stage[0]);
+        close(sinks[j].stage[1]);
+      }
+      return;
+    }
+    if (capacity > 0)
+      fcntl(sinks[k].stage[1], F_SETPIPE_SZ, capacity);
+  }
+
+  while (true)
+  {
+    ssize_t n = tee(in_fd, sinks[0].stage[1], INT_MAX, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    for (size_t k = 1; k < staged; k++)
+    {
+      if (!sinks[k].alive)
+        continue;
+      ssize_t m;
+      do
+      {
+        m = tee(in_fd, sinks[k].stage[1], n, 0);
+      } while (m < 0 && errno == EINTR);
+      if (m > 0)
+        fan_out_move(sinks[k].stage[0], sinks[k], m);
+      if (m != n)
+        sinks[k].alive = false;
+    }
+    fan_out_move(sinks[0].stage[0], sinks[0], n);
+    fan_out_move(in_fd, sinks.back(), n);
+    if (none_of(sinks.begin(), sinks.end(), [](const FanOutSink &sink)
+                { return sink.alive; }))
+      break;
+  }
+
+  for (size_t k = 0; k < staged; k++)
+  {
+    close(sinks[k].stage[0]);
+    close(sinks[k].stage[1]);
+  }
+}
+
+// Opens a file that fan_out will splice into. splice(2) rejects O_APPEND
+// targets, so ">>" is emulated by starting at the current end of the file.
+int open_fan_out_sink(const char *file, bool append)
+{
+  int fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0644);
+  if (fd >= 0 && append)
+    lseek(fd, 0, SEEK_END);
+  return fd;
+}
+
+// tee [-a] FILE...: copies in_fd to out_fd and to every FILE.
+int builtin_tee(const vector<string> &args, int in_fd, int out_fd)
+{
+  int status = 0;
+  bool append = false;
+  vector<int> sinks;
+  for (const auto &arg : args)
+  {
+    if (arg == "-a")
+    {
+      append = true;
+      continue;
+    }
+    int fd = open_fan_out_sink(arg.c_str(), append);
+    if (fd < 0)
+    {
+      cerr << "tee: " << arg << ": " << strerror(errno) << "\n";
+      status = 1;
+      continue;
+    }
+    sinks.push_back(fd);
+  }
+  sinks.push_back(out_fd);
+  fan_out(in_fd, sinks);
+  sinks.pop_back();
+  for (int fd : sinks)
+  {
+    close(fd);
+  }
+  return status;
+}
+
+// Spawn helper. An optional small process forked by shell_init before
+// readline, history or any thread exists, which launches external commands
+// on the shell's behalf, so launch cost does not depend on how large the
+// interactive shell grows. A request is a SpawnRequest header, carrying the
+// child's working directory and descriptors with SCM_RIGHTS, followed by the
+// path, argv and (only when it changed since the previous request) the
+// environment. The helper answers with the pid, then forwards every state
+// change of its children, which wait_child hands to the job code as if it
+// came from wait4.
+constexpr int SPAWN_MAX_FDS = 16;
+
+struct SpawnRequest
+{
+  int32_t pgid;
+  uint32_t nfds; // descriptors attached after the cwd, one per target
+  int32_t targets[SPAWN_MAX_FDS];
+  uint32_t path_len;
+  uint32_t argv_len; // NUL-terminated strings
+  int32_t env_len;   // -1: keep the previous environment
+};
+
+enum HelperEventKind : int32_t
+{
+  HELPER_SPAWNED, // value: 0 or the posix_spawn error
+  HELPER_STATUS   // value: the wait status
+};
+
+struct HelperEvent
+{
+  HelperEventKind kind;
+  int32_t pid;
+  int32_t value;
+  struct rusage usage;
+};
+
+static int helper_fd = -1;
+static bool helper_in_use = false;
+static deque<HelperEvent> helper_events; // status changes not yet collected
+static uint64_t helper_envp_build = UINT64_MAX;
+
+static bool read_all(int fd, void *data, size_t len)
+{
+  char *p = static_cast<char *>(data);
+  while (len > 0)
+  {
+    ssize_t got = read(fd, p, len);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return false;
+    p += got;
+    len -= got;
+  }
+  return true;
+}
+
+// Launches one request in the helper. Received descriptors are close-on-exec,
+// so nothing but the dup2'd targets reaches the child.
+static int helper_launch(const SpawnRequest &req, const int *fds, const vector<char> &payload,
+                         char *const *envp, pid_t &pid)
+{
+  if (fchdir(fds[0]) < 0)
+    return errno;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  for (uint32_t i = 0; i < req.nfds; i++)
+  {
+    posix_spawn_file_actions_adddup2(&actions, fds[i + 1], req.targets[i]);
+  }
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  for (int sig : {SIGPIPE, SIGTSTP, SIGTTIN, SIGTTOU})
+  {
+    sigaddset(&defaults, sig);
+  }
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  sigset_t mask;
+  sigemptyset(&mask);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  posix_spawnattr_setpgroup(&attr, req.pgid);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+  vector<char *> argv;
+  const char *path = payload.data();
+  for (size_t at = req.path_len; at < req.path_len + req.argv_len; at += strlen(payload.data() + at) + 1)
+  {
+    argv.push_back(const_cast<char *>(payload.data() + at));
+  }
+  argv.push_back(nullptr);
+  int err = posix_spawn(&pid, path, &actions, &attr, argv.data(), envp);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  return err;
+}
+
+[[noreturn]] static void spawn_helper_main(int sock)
+{
+  // Out of the terminal's foreground group, so keyboard signals only ever
+  // reach the commands. Children join the group named in each request.
+  setpgid(0, 0);
+  // Keep 0-2 taken so received descriptors never land on a dup2 target.
+  for (int fd = 0; fd < 3; fd++)
+  {
+    if (fcntl(fd, F_GETFD) < 0)
+      open("/dev/null", O_RDWR);
+  }
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, nullptr);
+  int chld_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+  vector<char> payload;
+  vector<char> env_data;
+  vector<char *> envp = {nullptr};
+  while (true)
+  {
+    struct pollfd pfds[2] = {{sock, POLLIN, 0}, {chld_fd, POLLIN, 0}};
+    if (poll(pfds, 2, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      _exit(1);
+    }
+    if (pfds[1].revents & POLLIN)
+    {
+      struct signalfd_siginfo info;
+      while (read(chld_fd, &info, sizeof(info)) > 0)
+      {
+      }
+      HelperEvent ev = {HELPER_STATUS, 0, 0, {}};
+      while ((ev.pid = wait4(-1, &ev.value, WNOHANG | WUNTRACED | WCONTINUED, &ev.usage)) > 0)
+      {
+        if (!write_all(sock, reinterpret_cast<const char *>(&ev), sizeof(ev)))
+          _exit(0);
+      }
+    }
+    if (!pfds[0].revents)
+      continue;
+
+    SpawnRequest req;
+    struct iovec iov = {&req, sizeof(req)};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * (SPAWN_MAX_FDS + 1))];
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (got <= 0)
+      _exit(0); // the shell is gone
+    int fds[SPAWN_MAX_FDS + 1];
+    size_t nfds = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+    {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+      {
+        nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+      }
+    }
+    size_t env_len = req.env_len < 0 ? 0 : req.env_len;
+    payload.resize(req.path_len + req.argv_len + env_len);
+    if (!read_all(sock, reinterpret_cast<char *>(&req) + got, sizeof(req) - got) ||
+        !read_all(sock, payload.data(), payload.size()))
+      _exit(0);
+    if (req.env_len >= 0)
+    {
+      env_data.assign(payload.end() - env_len, payload.end());
+      envp.clear();
+      for (size_t at = 0; at < env_data.size(); at += strlen(env_data.data() + at) + 1)
+      {
+        envp.push_back(env_data.data() + at);
+      }
+      envp.push_back(nullptr);
+    }
+    HelperEvent ev = {HELPER_SPAWNED, -1, EINVAL, {}};
+    if (nfds == req.nfds + 1)
+    {
+      pid_t pid;
+      ev.value = helper_launch(req, fds, payload, envp.data(), pid);
+      ev.pid = ev.value == 0 ? pid : -1;
+    }
+    for (size_t i = 0; i < nfds; i++)
+    {
+      close(fds[i]);
+    }
+    if (!write_all(sock, reinterpret_cast<const char *>(&ev), sizeof(ev)))
+      _exit(0);
+  }
+}
+
+bool start_spawn_helper()
+{
+  if (helper_fd != -1)
+    return true;
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+  {
+    perror("socketpair");
+    return false;
+  }
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    perror("fork");
+    close(sv[0]);
+    close(sv[1]);
+    return false;
+  }
+  if (pid == 0)
+  {
+    close(sv[0]);
+    spawn_helper_main(sv[1]);
+  }
+  close(sv[1]);
+  helper_fd = sv[0];
+  helper_envp_build = UINT64_MAX;
+  return true;
+}
+
+void use_spawn_helper(bool on)
+{
+  helper_in_use = on && helper_fd != -1;
+}
+
+// The helper died: its children can no longer be waited for, and commands go
+// back to being spawned by the shell.
+static void helper_lost()
+{
+  close(helper_fd);
+  helper_fd = -1;
+  helper_in_use = false;
+}
+
+// Queues the status changes the helper has sent without blocking. Returns
+// whether any was queued.
+static bool helper_read_events()
+{
+  bool queued = false;
+  while (helper_fd != -1)
+  {
+    HelperEvent ev;
+    ssize_t got = recv(helper_fd, &ev, sizeof(ev), MSG_DONTWAIT | MSG_PEEK);
+    if (got == 0)
+      helper_lost();
+    if (got < (ssize_t)sizeof(ev))
+      break;
+    read_all(helper_fd, &ev, sizeof(ev));
+    helper_events.push_back(ev);
+    queued = true;
+  }
+  return queued;
+}
+
+// Sends one spawn request and waits for the pid, queueing any status change
+// that arrives first. Returns -1 with err set when the command could not be
+// launched, or -1 with err == 0 when the helper is unusable.
+static pid_t helper_spawn(const string &path, const vector<string_view> &argv,
+                          const vector<pair<int, int>> &fds, pid_t pgid, int &err)
+{
+  err = 0;
+  // Resolve the dup2 sequence against the shell's own descriptors: the child
+  // gets the shell's stdin, stdout and stderr unless fds replaces them.
+  vector<pair<int, int>> installs = {{0, 0}, {1, 1}, {2, 2}}; // (target, source)
+  for (const auto &fd : fds)
+  {
+    int source = fd.first;
+    for (const auto &install : installs)
+    {
+      if (install.first == fd.first)
+        source = install.second;
+    }
+    auto it = find_if(installs.begin(), installs.end(), [&](const pair<int, int> &install)
+                      { return install.first == fd.second; });
+    if (it != installs.end())
+      it->second = source;
+    else
+      installs.emplace_back(fd.second, source);
+  }
+  int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (cwd < 0 || installs.size() > SPAWN_MAX_FDS)
+  {
+    if (cwd >= 0)
+      close(cwd);
+    return -1;
+  }
+  SpawnRequest req = {};
+  req.pgid = pgid >= 0 ? pgid : getpgrp();
+  int sent[SPAWN_MAX_FDS + 1] = {cwd};
+  for (const auto &install : installs)
+  {
+    if (fcntl(install.second, F_GETFD) < 0)
+      continue; // closed in the shell, so closed in the child
+    req.targets[req.nfds] = install.first;
+    sent[++req.nfds] = install.second;
+  }
+
+  string payload = path;
+  payload.push_back('\0');
+  for (string_view arg : argv)
+  {
+    payload.append(arg).push_back('\0');
+  }
+  req.path_len = path.size() + 1;
+  req.argv_len = payload.size() - req.path_len;
+  req.env_len = -1;
+  char *const *envp = shell_envp();
+  if (helper_envp_build != envp_builds)
+  {
+    size_t before = payload.size();
+    for (char *const *e = envp; *e; e++)
+    {
+      payload.append(*e).push_back('\0');
+    }
+    req.env_len = payload.size() - before;
+  }
+
+  struct iovec iov = {&req, sizeof(req)};
+  alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * (SPAWN_MAX_FDS + 1))] = {};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * (req.nfds + 1));
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int) * (req.nfds + 1));
+  memcpy(CMSG_DATA(c), sent, sizeof(int) * (req.nfds + 1));
+  ssize_t put;
+  do
+  {
+    put = sendmsg(helper_fd, &msg, 0);
+  } while (put < 0 && errno == EINTR);
+  close(cwd);
+  if (put < 0 || !write_all(helper_fd, reinterpret_cast<const char *>(&req) + put, sizeof(req) - put) ||
+      !write_all(helper_fd, payload.data(), payload.size()))
+  {
+    helper_lost();
+    return -1;
+  }
+  if (req.env_len >= 0)
+    helper_envp_build = envp_builds;
+
+  while (true)
+  {
+    HelperEvent ev;
+    if (!read_all(helper_fd, &ev, sizeof(ev)))
+    {
+      helper_lost();
+      return -1;
+    }
+    if (ev.kind == HELPER_STATUS)
+    {
+      helper_events.push_back(ev);
+      continue;
+    }
+    err = ev.value;
+    return ev.pid;
+  }
+}
+
+// Job control. Every pipeline launched by the shell is a job; the interactive
+// shell puts each one in its own process group and hands it the terminal while
+// it runs in the foreground. Background and stopped jobs live in the job table.
+// SIGCHLD is blocked and read from a signalfd, which the readline input hook
+// (job_getc) watches alongside the terminal, so jobs are reaped as soon as they
+// change state without any polling.
+struct JobProcess
+{
+  pid_t pid;
+  int stage = 0;
+  bool done = false;
+  bool stopped = false;
+  int status = 0;
+  struct rusage usage = {}; // from wait4, once done
+  double finished = 0;      // monotonic_seconds() when reaped
+};
+
+// A pipe of a foreground pipeline watched by adaptive pipe sizing: how often
+// it was found full while the pipeline ran.
+struct PipeWatch
+{
+  pid_t reader; // the stage reading it
+  int pipe;     // index of the stage writing it
+  int samples = 0;
+  int full = 0;
+};
+
+struct Job
+{
+  int id = 0;
+  pid_t pgid = 0;
+  vector<JobProcess> procs;
+  vector<PipeWatch> pipe_watch;
+  string text;
+  bool last_is_process = false;
+  int status = 0; // status of the last stage when it is not a process
+};
+
+static bool job_control = false;
+static pid_t shell_pgid = 0;
+static int sigchld_fd = -1;
+static map<int, Job> jobs;
+static int current_job = 0;
+
+int decode_status(int status)
+{
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  if (WIFSTOPPED(status))
+    return 128 + WSTOPSIG(status);
+  return 1;
+}
+
+// wait4(-1) over the shell's own children and the ones the spawn helper
+// launched, whose state changes arrive on its socket. With a timeout (in ms)
+// it returns 0 if nothing changed state in that time.
+static pid_t wait_child(int options, int &status, struct rusage &usage, int timeout = -1)
+{
+  while (true)
+  {
+    if (!helper_events.empty())
+    {
+      HelperEvent ev = helper_events.front();
+      helper_events.pop_front();
+      status = ev.value;
+      usage = ev.usage;
+      return ev.pid;
+    }
+    if (helper_fd == -1 && timeout < 0)
+      return wait4(-1, &status, options, &usage);
+    pid_t pid = wait4(-1, &status, options | WNOHANG, &usage);
+    if (pid > 0 || (pid < 0 && (errno != ECHILD || helper_fd == -1)))
+      return pid;
+    if (helper_read_events())
+      continue;
+    if (options & WNOHANG)
+      return 0;
+    struct pollfd fds[2] = {{helper_fd, POLLIN, 0}, {sigchld_fd, POLLIN, 0}};
+    int ready = poll(fds, 2, timeout);
+    if (ready <= 0)
+      return ready;
+    if (fds[1].revents & POLLIN)
+    {
+      struct signalfd_siginfo info;
+      while (read(sigchld_fd, &info, sizeof(info)) > 0)
+      {
+      }
+    }
+  }
+}
+
+double monotonic_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record_status(JobProcess &p, int status, const struct rusage &usage)
+{
+  if (WIFSTOPPED(status))
+  {
+    p.stopped = true;
+  }
+  else if (WIFCONTINUED(status))
+  {
+    p.stopped = false;
+  }
+  else
+  {
+    p.done = true;
+    p.stopped = false;
+    p.status = decode_status(status);
+    p.usage = usage;
+    p.finished = monotonic_seconds();
+  }
+}
+
+// Records a wait4 result against the process in `job` or in the job table.
+static void record_pid(pid_t pid, int status, const struct rusage &usage, Job *job)
+{
+  if (job)
+  {
+    for (auto &p : job->procs)
+    {
+      if (p.pid == pid)
+      {
+        record_status(p, status, usage);
+        return;
+      }
+    }
+  }
+  for (auto &entry : jobs)
+  {
+    for (auto &p : entry.second.procs)
+    {
+      if (p.pid == pid)
+        record_status(p, status, usage);
+    }
+  }
+}
+
+bool job_done(const Job &job)
+{
+  return all_of(job.procs.begin(), job.procs.end(), [](const JobProcess &p)
+                { return p.done; });
+}
+
+bool job_stopped(const Job &job)
+{
+  return !job_done(job) && any_of(job.procs.begin(), job.procs.end(), [](const JobProcess &p)
+                                  { return p.stopped; });
+}
+
+int job_status(const Job &job)
+{
+  if (job.last_is_process && !job.procs.empty())
+    return job.procs.back().status;
+  return job.status;
+}
+
+Job &add_job(Job job)
+{
+  job.id = jobs.empty() ? 1 : jobs.rbegin()->first + 1;
+  current_job = job.id;
+  return jobs[job.id] = move(job);
+}
+
+void print_job(const Job &job, ostream &out)
+{
+  string state = job_done(job) ? (job_status(job) == 0 ? "Done" : "Exit " + to_string(job_status(job)))
+                 : job_stopped(job) ? "Stopped"
+                                    : "Running";
+  out << "[" << job.id << "]" << (job.id == current_job ? "+" : " ") << "  "
+      << left << setw(24) << state << right << job.text << (state == "Running" ? " &" : "") << "\n";
+}
+
+// Reaps every child that changed state and updates the job table.
+void reap_jobs()
+{
+  if (sigchld_fd != -1)
+  {
+    struct signalfd_siginfo info;
+    while (read(sigchld_fd, &info, sizeof(info)) > 0)
+    {
+    }
+  }
+  while (true)
+  {
+    int status;
+    struct rusage usage;
+    pid_t pid = wait_child(WNOHANG | WUNTRACED | WCONTINUED, status, usage);
+    if (pid <= 0)
+      break;
+    record_pid(pid, status, usage, nullptr);
+  }
+}
+
+// Reports and forgets finished background jobs; called before each prompt.
+void notify_jobs(bool report)
+{
+  reap_jobs();
+  for (auto it = jobs.begin(); it != jobs.end();)
+  {
+    if (!job_done(it->second))
+    {
+      ++it;
+      continue;
+    }
+    if (report)
+      print_job(it->second, cout);
+    it = jobs.erase(it);
+  }
+}
+
+// Readline input hook: waits on the terminal, the SIGCHLD signalfd and the
+// spawn helper's socket together.
+int job_getc(FILE *stream)
+{
+  while (true)
+  {
+    struct pollfd fds[3] = {{fileno(stream), POLLIN, 0}, {sigchld_fd, POLLIN, 0}, {helper_fd, POLLIN, 0}};
+    if (poll(fds, 3, -1) < 0)
+    {
+      if (errno == EINTR && !rl_pending_signal())
+        continue;
+      return rl_getc(stream);
+    }
+    if (fds[1].revents & POLLIN || fds[2].revents)
+      reap_jobs();
+    if (fds[0].revents)
+      return rl_getc(stream);
+  }
+}
+
+constexpr int PIPE_SAMPLE_MS = 10;
+
+// Samples the watched pipes through each reader's /proc/<pid>/fd/0. The open
+// is only a momentary extra reader: the shell keeps no pipe end, so a writer
+// still gets SIGPIPE when its reader exits. A pipe counts as full when less
+// than a page of it is free.
+static void sample_pipes(Job &job)
+{
+  for (auto &w : job.pipe_watch)
+  {
+    int fd = open(("/proc/" + to_string(w.reader) + "/fd/0").c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    int capacity = fcntl(fd, F_GETPIPE_SZ);
+    int queued = 0;
+    if (capacity > 0 && ioctl(fd, FIONREAD, &queued) == 0)
+    {
+      w.samples++;
+      if (queued > capacity - 4096)
+        w.full++;
+    }
+    close(fd);
+  }
+}
+
+// Waits for a job in the foreground. If it stops (Ctrl-Z) it is moved to the
+// job table. Returns the job's status. Children are collected with wait4(-1)
+// in the order they exit, so each stage's finish time and rusage are exact;
+// background children reaped along the way are recorded in the job table.
+// Pipes watched by adaptive pipe sizing are sampled while it waits.
+int wait_foreground(Job &job)
+{
+  TraceScope trace("wait", job.text);
+  if (job_control && job.pgid > 0)
+    tcsetpgrp(STDIN_FILENO, job.pgid);
+  auto pending = [&job]()
+  {
+    return any_of(job.procs.begin(), job.procs.end(), [](const JobProcess &p)
+                  { return !p.done && !p.stopped; });
+  };
+  while (pending())
+  {
+    int status;
+    struct rusage usage;
+    pid_t pid = wait_child(job_control ? WUNTRACED : 0, status, usage,
+                           job.pipe_watch.empty() ? -1 : PIPE_SAMPLE_MS);
+    if (pid == 0)
+    {
+      sample_pipes(job);
+      continue;
+    }
+    if (pid < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      for (auto &p : job.procs)
+      {
+        if (!p.done && !p.stopped)
+        {
+          p.done = true;
+          p.status = 1;
+        }
+      }
+      break;
+    }
+    record_pid(pid, status, usage, &job);
+  }
+  if (job_control)
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+  if (job_stopped(job))
+  {
+    Job &stopped = job.id ? job : add_job(job);
+    current_job = stopped.id;
+    cout << "\n";
+    print_job(stopped, cout);
+    return 128 + SIGTSTP;
+  }
+  return job_status(job);
+}
+
+static void continue_job(Job &job)
+{
+  for (auto &p : job.procs)
+  {
+    p.stopped = false;
+  }
+  if (job.pgid > 0 && job_control)
+    kill(-job.pgid, SIGCONT);
+  else
+    for (auto &p : job.procs)
+    {
+      if (!p.done)
+        kill(p.pid, SIGCONT);
+    }
+}
+
+// Resolves a job spec (%n, %+, %%, n or nothing for the current job).
+Job *find_job(const vector<string> &args, const string &name, ostream &out)
+{
+  reap_jobs();
+  int id = current_job;
+  if (!args.empty() && args[0] != "%+" && args[0] != "%%")
+  {
+    string spec = args[0][0] == '%' ? args[0].substr(1) : args[0];
+    try
+    {
+      id = stoi(spec);
+    }
+    catch (...)
+    {
+      id = -1;
+    }
+  }
+  auto it = jobs.find(id);
+  if (it == jobs.end())
+  {
+    out << name << ": " << (args.empty() ? "current" : args[0]) << ": no such job\n";
+    return nullptr;
+  }
+  return &it->second;
+}
+
+// In a pipeline stage only a snapshot is printed; reaping and forgetting jobs
+// is left to the interactive loop.
+void builtin_jobs(ostream &out, bool subshell)
+{
+  if (subshell)
+  {
+    for (auto &[id, job] : jobs)
+      print_job(job, out);
+    return;
+  }
+  reap_jobs();
+  for (auto it = jobs.begin(); it != jobs.end();)
+  {
+    print_job(it->second, out);
+    it = job_done(it->second) ? jobs.erase(it) : next(it);
+  }
+}
+
+// Returns the job's status once it finishes or stops again.
+int builtin_fg(const vector<string> &args, ostream &out)
+{
+  Job *job = find_job(args, "fg", out);
+  if (!job)
+    return 1;
+  out << job->text << "\n";
+  out.flush();
+  current_job = job->id;
+  continue_job(*job);
+  int status = wait_foreground(*job);
+  if (job_done(*job))
+    jobs.erase(job->id);
+  return status;
+}
+
+int builtin_bg(const vector<string> &args, ostream &out)
+{
+  Job *job = find_job(args, "bg", out);
+  if (!job)
+    return 1;
+  current_job = job->id;
+  continue_job(*job);
+  out << "[" << job->id << "]+ " << job->text << " &\n";
+  return 0;
+}
+
+// wait [%job|pid...]: with no arguments waits for every background job.
+// Returns the status of the last job named (0 with no arguments), or 127 if
+// it is not a job of this shell.
+int builtin_wait(const vector<string> &args, ostream &out)
+{
+  int status = 0;
+  bool last_missing = false;
+  vector<int> ids;
+  if (args.empty())
+  {
+    for (const auto &entry : jobs)
+    {
+      ids.push_back(entry.first);
+    }
+  }
+  for (const auto &arg : args)
+  {
+    if (arg[0] == '%')
+    {
+      Job *job = find_job({arg}, "wait", out);
+      if (job)
+        ids.push_back(job->id);
+      last_missing = !job;
+      continue;
+    }
+    pid_t pid = atoi(arg.c_str());
+    bool found = false;
+    for (const auto &entry : jobs)
+    {
+      for (const auto &p : entry.second.procs)
+      {
+        if (p.pid == pid)
+        {
+          ids.push_back(entry.first);
+          found = true;
+        }
+      }
+    }
+    if (!found)
+      out << "wait: pid " << arg << " is not a child of this shell\n";
+    last_missing = !found;
+  }
+  for (int id : ids)
+  {
+    auto it = jobs.find(id);
+    if (it == jobs.end() || job_stopped(it->second))
+      continue;
+    for (auto &p : it->second.procs)
+    {
+      int status;
+      struct rusage usage;
+      pid_t pid;
+      while (!p.done && (pid = wait_child(0, status, usage)) > 0)
+      {
+        record_pid(pid, status, usage, &it->second);
+      }
+      if (!p.done)
+        p.done = true;
+    }
+    if (!args.empty())
+      status = job_status(it->second);
+    jobs.erase(it);
+  }
+  return last_missing ? 127 : status;
+}
+
+bool is_builtin(const string &cmd)
+{
+  return find(builtins.begin(), builtins.end(), cmd) != builtins.end();
+}
+
+void get_err(short int err_code, string command_i, ostream &out = cout)
+{
+  switch (err_code)
+  {
+  case 1:
+    out << command_i << ": not found\n";
+    break;
+  case 2:
+    out << "error: no arguments provided\n";
+    break;
+  }
+  err_code = 0;
+}
+
+// History store. HISTFILE is an append-only log with one command per line:
+// each command is written with a single O_APPEND write as it is entered, so
+// concurrent shells interleave whole lines and never overwrite each other.
+// At startup the log is only mmap'd; its offset index and the duplicate
+// index are built the first time the whole history is needed (`history`,
+// -w, -a). Readline's own list, used for arrow-key recall, is seeded with the
+// last HISTORY_RECALL lines and stifled to that size.
+// A command entered again replaces its earlier occurrence: the old entry is
+// marked dead and skipped by `history` and `history -w`.
+static const int HISTORY_RECALL = 1000;
+
+struct HistoryStore
+{
+  int log_fd = -1;
+  const char *map = nullptr;
+  size_t map_len = 0;
+  bool indexed = false;
+  deque<string> added;          // entries entered or read this session, in order
+  vector<string_view> entries;  // every entry, duplicates included
+  vector<bool> live;            // false once an entry has a later duplicate
+  vector<uint32_t> uses;        // times the command was entered, up to this entry
+  size_t map_entries = 0;       // entries [0, map_entries) lie in the map, in order
+  vector<uint32_t> slots;       // open-addressing table of entry index + 1
+  size_t live_count = 0;
+};
+
+static HistoryStore hist;
+
+static void history_grow_slots()
+{
+  vector<uint32_t> old;
+  old.swap(hist.slots);
+  hist.slots.assign(max<size_t>(1024, old.size() * 2), 0);
+  size_t mask = hist.slots.size() - 1;
+  for (uint32_t slot : old)
+  {
+    if (!slot)
+      continue;
+    size_t i = hash<string_view>()(hist.entries[slot - 1]) & mask;
+    while (hist.slots[i])
+      i = (i + 1) & mask;
+    hist.slots[i] = slot;
+  }
+}
+
+static void history_index_entry(string_view line)
+{
+  if ((hist.live_count + 1) * 2 > hist.slots.size())
+    history_grow_slots();
+  uint32_t slot = hist.entries.size() + 1;
+  hist.entries.push_back(line);
+  hist.live.push_back(true);
+  hist.uses.push_back(1);
+  size_t mask = hist.slots.size() - 1;
+  size_t i = hash<string_view>()(line) & mask;
+  while (hist.slots[i])
+  {
+    if (hist.entries[hist.slots[i] - 1] == line)
+    {
+      hist.live[hist.slots[i] - 1] = false;
+      hist.uses.back() = hist.uses[hist.slots[i] - 1] + 1;
+      hist.slots[i] = slot;
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+  hist.slots[i] = slot;
+  hist.live_count++;
+}
+
+// Builds the index over the mapped log and everything added since startup.
+static void history_build_index()
+{
+  if (hist.indexed)
+    return;
+  hist.indexed = true;
+  const char *p = hist.map;
+  const char *end = hist.map + hist.map_len;
+  while (p < end)
+  {
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    if (!nl)
+      nl = end;
+    if (nl > p)
+      history_index_entry(string_view(p, nl - p));
+    p = nl + 1;
+  }
+  hist.map_entries = hist.entries.size();
+  for (const string &line : hist.added)
+  {
+    history_index_entry(line);
+  }
+}
+
+static void history_add(string line)
+{
+  hist.added.push_back(move(line));
+  if (hist.indexed)
+    history_index_entry(hist.added.back());
+}
+
+// Writes lines to fd, one per line, in large chunks.
+static bool history_write_lines(int fd, const vector<string_view> &lines)
+{
+  string buf;
+  for (string_view line : lines)
+  {
+    buf.append(line);
+    buf.push_back('\n');
+    if (buf.size() >= (1 << 16))
+    {
+      if (!write_all(fd, buf.data(), buf.size()))
+        return false;
+      buf.clear();
+    }
+  }
+  return write_all(fd, buf.data(), buf.size());
+}
+
+static bool same_file(int fd, const string &path)
+{
+  struct stat a, b;
+  return fd >= 0 && fstat(fd, &a) == 0 && stat(path.c_str(), &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+// Records a command entered at the prompt.
+void history_append(const string &line)
+{
+  add_history(line.c_str());
+  history_add(line);
+  if (hist.log_fd >= 0)
+  {
+    string record = line + "\n";
+    if (!write_all(hist.log_fd, record.data(), record.size()))
+      perror("history");
+  }
+}
+
+// History search, used by `history -s` and the Ctrl-R widget. A query first
+// matches as a substring; only when nothing contains it does it fall back to
+// fuzzy (subsequence) matching. Substring search runs over the mapped log as
+// one buffer with an SSE2 first/last-byte filter, so a full scan touches each
+// byte once; fuzzy matching chains memchr calls within each entry. Results
+// are ranked once per full scan by frecency and stay ranked when filtered.
+
+// Finds needle in hay. Candidate positions are those where both the first and
+// the last byte of the needle match, tested 16 positions at a time.
+static const char *find_substring(const char *hay, size_t n, string_view needle)
+{
+  size_t k = needle.size();
+  if (k > n)
+    return nullptr;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[k - 1]);
+  for (; i + k + 15 <= n; i += 16)
+  {
+    __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + k - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+    while (mask)
+    {
+      size_t at = i + __builtin_ctz(mask);
+      if (k <= 2 || memcmp(hay + at + 1, needle.data() + 1, k - 2) == 0)
+        return hay + at;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i + k <= n; i++)
+  {
+    if (hay[i] == needle[0] && memcmp(hay + i, needle.data(), k) == 0)
+      return hay + i;
+  }
+  return nullptr;
+}
+
+static bool fuzzy_match(string_view text, string_view query)
+{
+  const char *p = text.data();
+  const char *end = text.data() + text.size();
+  for (char ch : query)
+  {
+    p = (const char *)memchr(p, ch, end - p);
+    if (!p)
+      return false;
+    p++;
+  }
+  return true;
+}
+
+// Frecency: commands entered often and recently come first.
+static double history_score(uint32_t i)
+{
+  double age = hist.entries.size() - i;
+  return (1 + log2(hist.uses[i])) / (1 + age / 100);
+}
+
+static void history_rank(vector<uint32_t> &matches)
+{
+  vector<pair<double, uint32_t>> scored;
+  scored.reserve(matches.size());
+  for (uint32_t i : matches)
+  {
+    scored.emplace_back(history_score(i), i);
+  }
+  sort(scored.begin(), scored.end(), greater<>());
+  for (size_t j = 0; j < scored.size(); j++)
+  {
+    matches[j] = scored[j].second;
+  }
+}
+
+static vector<uint32_t> history_scan(string_view query, bool fuzzy)
+{
+  vector<uint32_t> matches;
+  uint32_t first_added = hist.map_entries;
+  if (fuzzy)
+  {
+    first_added = 0;
+  }
+  else
+  {
+    // Map a hit back to its entry, then resume after that entry's line.
+    size_t pos = 0;
+    while (const char *hit = find_substring(hist.map + pos, hist.map_len - pos, query))
+    {
+      auto it = upper_bound(hist.entries.begin(), hist.entries.begin() + hist.map_entries, hit,
+                            [](const char *p, string_view e)
+                            { return p < e.data(); });
+      uint32_t i = it - hist.entries.begin() - 1;
+      if (hist.live[i])
+        matches.push_back(i);
+      pos = hist.entries[i].data() + hist.entries[i].size() - hist.map;
+    }
+  }
+  for (uint32_t i = first_added; i < hist.entries.size(); i++)
+  {
+    string_view e = hist.entries[i];
+    if (hist.live[i] && (fuzzy ? fuzzy_match(e, query) : find_substring(e.data(), e.size(), query) != nullptr))
+      matches.push_back(i);
+  }
+  history_rank(matches);
+  return matches;
+}
+
+// Incremental search state: one level per refinement. Typing more narrows the
+// previous level's matches instead of rescanning; deleting pops back to a
+// level that is still a prefix of the query.
+struct HistorySearch
+{
+  struct Level
+  {
+    string query;
+    vector<uint32_t> matches;
+    bool fuzzy;
+  };
+  vector<Level> levels;
+
+  const vector<uint32_t> &search(const string &query)
+  {
+    static const vector<uint32_t> none;
+    while (!levels.empty() && query.compare(0, levels.back().query.size(), levels.back().query) != 0)
+      levels.pop_back();
+    if (query.empty())
+      return none;
+    if (!levels.empty() && levels.back().query == query)
+      return levels.back().matches;
+
+    Level next{query, {}, false};
+    if (levels.empty())
+    {
+      history_build_index();
+      next.matches = history_scan(query, false);
+    }
+    else
+    {
+      const Level &prev = levels.back();
+      next.fuzzy = prev.fuzzy;
+      for (uint32_t i : prev.matches)
+      {
+        string_view e = hist.entries[i];
+        if (prev.fuzzy ? fuzzy_match(e, query) : find_substring(e.data(), e.size(), query) != nullptr)
+          next.matches.push_back(i);
+      }
+    }
+    if (next.matches.empty() && !next.fuzzy)
+    {
+      next.fuzzy = true;
+      next.matches = history_scan(query, true);
+    }
+    levels.push_back(move(next));
+    return levels.back().matches;
+  }
+};
+
+// Ctrl-R: incremental search. Typing refines, Backspace widens, Ctrl-R moves
+// to the next match, Enter runs the match, Ctrl-G restores the original line,
+// and any other key leaves the match in the line and is then handled as usual.
+static int history_search_widget(int, int)
+{
+  HistorySearch state;
+  string original(rl_line_buffer);
+  string query;
+  size_t choice = 0;
+  string_view shown;
+  while (true)
+  {
+    const vector<uint32_t> &matches = state.search(query);
+    if (choice >= matches.size())
+      choice = 0;
+    shown = matches.empty() ? string_view() : hist.entries[matches[choice]];
+    rl_message("(history search)`%s': %.*s", query.c_str(), (int)shown.size(), shown.data());
+
+    int c = rl_read_key();
+    if (c == '\r' || c == '\n')
+    {
+      rl_clear_message();
+      rl_replace_line(string(matches.empty() ? string_view(original) : shown).c_str(), 0);
+      rl_point = rl_end;
+      return rl_newline(1, c);
+    }
+    if (c == ('G' & 0x1f))
+    {
+      rl_clear_message();
+      rl_replace_line(original.c_str(), 0);
+      rl_point = rl_end;
+      return 0;
+    }
+    if (c == ('R' & 0x1f))
+    {
+      choice++;
+    }
+    else if (c == 127 || c == '\b')
+    {
+      if (!query.empty())
+        query.pop_back();
+      choice = 0;
+    }
+    else if ((unsigned char)c >= 32 && c != 127)
+    {
+      query.push_back(c);
+      choice = 0;
+    }
+    else
+    {
+      rl_clear_message();
+      if (!matches.empty())
+      {
+        rl_replace_line(string(shown).c_str(), 0);
+        rl_point = rl_end;
+      }
+      rl_stuff_char(c);
+      return 0;
+    }
+  }
+}
+
+int builtin_history(const vector<string> &arguments, ostream &out)
+{
+  if (arguments.size() == 2 && arguments[0] == "-r")
+  {
+    int fd = open(arguments[1].c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      perror("history");
+      return 1;
+    }
+    string data;
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+      data.append(buf, n);
+    }
+    close(fd);
+    istringstream lines(data);
+    string line;
+    while (getline(lines, line))
+    {
+      if (line.empty())
+        continue;
+      add_history(line.c_str());
+      history_add(move(line));
+    }
+    return 0;
+  }
+  if (arguments.size() == 2 && arguments[0] == "-w")
+  {
+    // Written to a temporary file and renamed into place, so a mapped log
+    // is never truncated under a reader.
+    history_build_index();
+    vector<string_view> lines;
+    lines.reserve(hist.live_count);
+    for (size_t i = 0; i < hist.entries.size(); i++)
+    {
+      if (hist.live[i])
+        lines.push_back(hist.entries[i]);
+    }
+    bool is_log = same_file(hist.log_fd, arguments[1]);
+    string tmp = arguments[1] + ".tmp" + to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || !history_write_lines(fd, lines) || close(fd) != 0 || rename(tmp.c_str(), arguments[1].c_str()) != 0)
+    {
+      perror("history");
+      unlink(tmp.c_str());
+      return 1;
+    }
+    if (is_log)
+    {
+      close(hist.log_fd);
+      hist.log_fd = open(arguments[1].c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+    last_history_written = hist.added.size();
+    return 0;
+  }
+  if (arguments.size() == 2 && arguments[0] == "-a")
+  {
+    int status = 0;
+    // Commands entered at the prompt are already in HISTFILE.
+    if (!same_file(hist.log_fd, arguments[1]) && last_history_written < (int)hist.added.size())
+    {
+      vector<string_view> lines(hist.added.begin() + last_history_written, hist.added.end());
+      int fd = open(arguments[1].c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+      if (fd < 0 || !history_write_lines(fd, lines))
+      {
+        perror("history");
+        status = 1;
+      }
+      if (fd >= 0)
+        close(fd);
+    }
+    last_history_written = hist.added.size();
+    return status;
+  }
+  if (arguments.size() >= 2 && arguments[0] == "-s")
+  {
+    // Ranked matches, best first, with their `history` numbers.
+    string query = arguments[1];
+    for (size_t i = 2; i < arguments.size(); i++)
+    {
+      query += " " + arguments[i];
+    }
+    HistorySearch state;
+    vector<uint32_t> matches = state.search(query);
+    vector<uint32_t> by_index = matches;
+    sort(by_index.begin(), by_index.end());
+    unordered_map<uint32_t, size_t> numbers;
+    size_t number = 0;
+    size_t next = 0;
+    for (uint32_t i = 0; i < hist.entries.size() && next < by_index.size(); i++)
+    {
+      if (hist.live[i])
+        number++;
+      if (i == by_index[next])
+        numbers[by_index[next++]] = number;
+    }
+    for (uint32_t i : matches)
+    {
+      out << setw(5) << numbers[i] << "  " << hist.entries[i] << "\n";
+    }
+    return 0;
+  }
+  history_build_index();
+  size_t n = hist.live_count;
+  if (!arguments.empty())
+  {
+    try
+    {
+      n = min<size_t>(max(0, stoi(arguments[0])), hist.live_count);
+    }
+    catch (...)
+    {
+      n = hist.live_count;
+    }
+  }
+  // Walk back from the newest entry to find the first of the last n.
+  size_t start = hist.entries.size();
+  for (size_t seen = 0; seen < n; seen++)
+  {
+    do
+      start--;
+    while (!hist.live[start]);
+  }
+  size_t number = hist.live_count - n + 1;
+  for (size_t i = start; i < hist.entries.size(); i++)
+  {
+    if (hist.live[i])
+      out << setw(5) << number++ << "  " << hist.entries[i] << "\n";
+  }
+  return 0;
+}
+
+// cd inside a pipeline behaves as it would in a subshell: the target is
+// checked and errors are reported, but the shell's directory is unchanged.
+int builtin_cd(const vector<string> &arguments, ostream &out, bool subshell)
+{
+  if (arguments.empty())
+  {
+    get_err(2, "cd", out);
+    return 1;
+  }
+  filesystem::path path_new = arguments[0];
+  if (path_new == "~")
+  {
+    const char *home_dir = variable_value("HOME");
+    if (!home_dir)
+    {
+      out << "cd: " << arguments[0] << ": HOME not set\n";
+      return 1;
+    }
+    path_new = home_dir;
+  }
+  error_code e;
+  if (subshell)
+  {
+    if (!filesystem::is_directory(path_new, e) && !e)
+      e = make_error_code(errc::not_a_directory);
+  }
+  else
+  {
+    string old = filesystem::current_path(e).string();
+    filesystem::current_path(path_new, e);
+    if (!e)
+    {
+      set_variable("OLDPWD", old);
+      set_variable("PWD", filesystem::current_path(e).string());
+    }
+  }
+  if (e)
+  {
+    out << "cd: " << arguments[0] << ": " << e.message() << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+// export NAME=value / export NAME mark variables for the environment of
+// spawned commands; with no arguments, lists the exported ones.
+int builtin_export(const vector<string> &args, ostream &out)
+{
+  int status = 0;
+  for (const auto &arg : args)
+  {
+    size_t eq = arg.find('=');
+    string_view name = string_view(arg).substr(0, eq);
+    if (name.empty() || !is_name_start(name[0]) || !all_of(name.begin(), name.end(), is_name_char))
+    {
+      out << "export: `" << arg << "': not a valid identifier\n";
+      status = 1;
+    }
+    else if (eq == string::npos)
+      export_variable(name);
+    else
+      set_variable(name, string_view(arg).substr(eq + 1), true);
+  }
+  if (!args.empty())
+    return status;
+  vector<const Variable *> exported;
+  for (const auto &v : variables)
+  {
+    if (v.set && v.exported)
+      exported.push_back(&v);
+  }
+  sort(exported.begin(), exported.end(), [](const Variable *a, const Variable *b)
+       { return a->entry < b->entry; });
+  for (const Variable *v : exported)
+  {
+    out << "export " << string_view(v->entry).substr(0, v->name_len) << "=\"";
+    for (const char *p = value_of(*v); *p; p++)
+    {
+      if (*p == '"' || *p == '\\' || *p == '$')
+        out << '\\';
+      out << *p;
+    }
+    out << "\"\n";
+  }
+  return 0;
+}
+
+// `exit [N]`: the status to exit with, or nullopt (after an error message)
+// when N is not a number.
+static optional<int> exit_status(const vector<string> &args, ostream &out)
+{
+  if (args.empty())
+    return 0;
+  const string &arg = args[0];
+  size_t digits = arg[0] == '-' || arg[0] == '+' ? 1 : 0;
+  if (arg.size() == digits || arg.size() > 18 || !all_of(arg.begin() + digits, arg.end(), ::isdigit))
+  {
+    out << "exit: " << arg << ": numeric argument required\n";
+    return nullopt;
+  }
+  return (int)(stol(arg) & 0xff);
+}
+
+// Single dispatch point for builtins, used both for standalone commands and
+// for pipeline stages; returns the builtin's exit status. `exit` is handled
+// by the REPL itself; inside a pipeline it only yields its status, as it
+// would in a subshell.
+int run_builtin(const string &cmd, const vector<string> &args, ostream &out, bool subshell)
+{
+  TraceScope trace("builtin", cmd);
+  if (cmd == "echo")
+  {
+    for (size_t i = 0; i < args.size(); i++)
+    {
+      out << args[i];
+      if (i + 1 < args.size())
+        out << " ";
+    }
+    out << "\n";
+    return 0;
+  }
+
+  if (cmd == "pwd")
+  {
+    out << filesystem::current_path().string() << "\n";
+    return 0;
+  }
+
+  if (cmd == "type")
+  {
+    if (args.empty())
+    {
+      get_err(2, cmd, out);
+      return 1;
+    }
+    if (is_builtin(args[0]))
+    {
+      out << args[0] << " is a shell builtin\n";
+      return 0;
+    }
+    auto p = find_in_path(args[0], false);
+    if (!p)
+    {
+      get_err(1, args[0], out);
+      return 1;
+    }
+    out << args[0] << " is " << *p << "\n";
+    return 0;
+  }
+
+  if (cmd == "hash")
+    return builtin_hash(args, out);
+
+  if (cmd == "history")
+    return builtin_history(args, out);
+
+  if (cmd == "cd")
+    return builtin_cd(args, out, subshell);
+
+  if (cmd == "tee")
+  {
+    out.flush();
+    return builtin_tee(args, STDIN_FILENO, STDOUT_FILENO);
+  }
+
+  if (cmd == "jobs")
+  {
+    builtin_jobs(out, subshell);
+    return 0;
+  }
+
+  if (cmd == "fg" || cmd == "bg")
+  {
+    if (subshell)
+    {
+      out << cmd << ": no job control\n";
+      return 1;
+    }
+    return cmd == "fg" ? builtin_fg(args, out) : builtin_bg(args, out);
+  }
+
+  if (cmd == "wait")
+    return subshell ? 0 : builtin_wait(args, out);
+
+  if (cmd == "exit")
+    return exit_status(args, out).value_or(2);
+
+  if (cmd == "cache")
+  {
+    out << "cache: only supported for a single command\n";
+    return 1;
+  }
+
+  if (cmd == "export")
+  {
+    if (!subshell || args.empty())
+      return builtin_export(args, out);
+    return 0;
+  }
+
+  if (cmd == "unset")
+  {
+    for (const auto &name : args)
+    {
+      if (!subshell)
+        unset_variable(name);
+    }
+    return 0;
+  }
+
+  return 127;
+}
+
+// Buffered streambuf over a raw file descriptor; builtins write through one
+// instead of cout, so their output reaches the fd in 64 KiB writes and is
+// flushed when the builtin returns (or explicitly, before fg blocks).
+class FdStreamBuf : public streambuf
+{
+public:
+  explicit FdStreamBuf(int fd) : fd(fd)
+  {
+    setp(buffer, buffer + sizeof(buffer));
+  }
+
+  ~FdStreamBuf() override
+  {
+    sync();
+  }
+
+protected:
+  int overflow(int ch) override
+  {
+    if (!flush_buffer())
+      return traits_type::eof();
+    if (ch != traits_type::eof())
+    {
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  int sync() override
+  {
+    return flush_buffer() ? 0 : -1;
+  }
+
+private:
+  bool flush_buffer()
+  {
+    const char *p = pbase();
+    while (p < pptr())
+    {
+      ssize_t written = write(fd, p, pptr() - p);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+      {
+        // Reader went away (EPIPE; SIGPIPE is ignored by the shell): drop output.
+        setp(buffer, buffer + sizeof(buffer));
+        return false;
+      }
+      p += written;
+    }
+    setp(buffer, buffer + sizeof(buffer));
+    return true;
+  }
+
+  int fd;
+  char buffer[1 << 16];
+};
+
+// In-process filters. cat, head, wc and grep -F stages that use only the forms
+// below run inside the shell, and adjacent ones are fused into one chain that
+// hands data from filter to filter as string_views, with no pipes or processes
+// between them. Input files are mmap'd. Any other option (or several files
+// for head, wc or grep) runs the real binary. SHELL_FILTERS=0 turns this off.
+//   cat [FILE...]  head [-n N | -N] [FILE]  wc -l|-w|-c [FILE]
+//   grep -F [-v] [-c] PATTERN [FILE]
+struct FilterSpec
+{
+  string cmd;
+  vector<string> files;
+  long lines = 10; // head
+  char unit = 0;   // wc: 'l', 'w' or 'c'
+  string pattern;  // grep
+  bool invert = false;
+  bool count_only = false;
+};
+
+static bool filters_enabled()
+{
+  const char *setting = variable_value("SHELL_FILTERS");
+  return !setting || strcmp(setting, "0") != 0;
+}
+
+static bool parse_count(const string &text, long &value)
+{
+  if (text.empty() || text.size() > 18 || !all_of(text.begin(), text.end(), ::isdigit))
+    return false;
+  value = stol(text);
+  return true;
+}
+
+static optional<FilterSpec> parse_filter(const SimpleCommand &command)
+{
+  FilterSpec spec;
+  spec.cmd = string(command.words[0]);
+  vector<string> operands;
+  bool fixed = false;
+  for (size_t i = 1; i < command.words.size(); i++)
+  {
+    string arg(command.words[i]);
+    if (arg.size() < 2 || arg[0] != '-')
+    {
+      operands.push_back(arg);
+      continue;
+    }
+    if (spec.cmd == "head")
+    {
+      if (arg == "-n" && i + 1 < command.words.size())
+      {
+        if (!parse_count(string(command.words[++i]), spec.lines))
+          return nullopt;
+      }
+      else if (!parse_count(arg.substr(arg[1] == 'n' ? 2 : 1), spec.lines))
+        return nullopt;
+    }
+    else if (spec.cmd == "wc" && arg.size() == 2 && strchr("lwc", arg[1]) && !spec.unit)
+    {
+      spec.unit = arg[1];
+    }
+    else if (spec.cmd == "grep")
+    {
+      for (char flag : arg.substr(1))
+      {
+        if (flag == 'F')
+          fixed = true;
+        else if (flag == 'v')
+          spec.invert = true;
+        else if (flag == 'c')
+          spec.count_only = true;
+        else
+          return nullopt;
+      }
+    }
+    else
+      return nullopt;
+  }
+  if (spec.cmd == "cat")
+  {
+    if (find(operands.begin(), operands.end(), "-") != operands.end())
+      return nullopt;
+    spec.files = operands;
+    return spec;
+  }
+  if (spec.cmd == "grep")
+  {
+    if (!fixed || operands.empty() || operands[0].empty() || operands[0].find('\n') != string::npos)
+      return nullopt;
+    spec.pattern = operands[0];
+    operands.erase(operands.begin());
+  }
+  else if (spec.cmd == "wc")
+  {
+    if (!spec.unit)
+      return nullopt;
+  }
+  else if (spec.cmd != "head")
+    return nullopt;
+  if (operands.size() > 1 || (operands.size() == 1 && operands[0] == "-"))
+    return nullopt;
+  spec.files = operands;
+  return spec;
+}
+
+static size_t count_newlines(const char *p, size_t n)
+{
+  size_t count = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  // Compare results (-1 per newline) are subtracted into byte counters, which
+  // are summed with psadbw before they can overflow (255 blocks).
+  const __m128i nl = _mm_set1_epi8('\n');
+  while (i + 16 <= n)
+  {
+    __m128i counters = _mm_setzero_si128();
+    size_t end = min(n - 15, i + 255 * 16);
+    for (; i < end; i += 16)
+    {
+      __m128i block = _mm_loadu_si128((const __m128i *)(p + i));
+      counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(block, nl));
+    }
+    __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+    count += _mm_extract_epi16(sums, 0) + _mm_extract_epi16(sums, 4);
+  }
+#endif
+  for (; i < n; i++)
+  {
+    count += p[i] == '\n';
+  }
+  return count;
+}
+
+class Filter
+{
+public:
+  virtual ~Filter() = default;
+  // Takes the next piece of input. Returns false once no more is wanted.
+  virtual bool write(string_view data) = 0;
+  // End of input.
+  virtual void finish()
+  {
+    if (next)
+      next->finish();
+  }
+
+  Filter *next = nullptr;
+
+protected:
+  bool emit(string_view data)
+  {
+    return data.empty() || next->write(data);
+  }
+};
+
+// End of a chain: batches small pieces and writes large ones straight through.
+class FdSink : public Filter
+{
+public:
+  explicit FdSink(int fd) : fd(fd) {}
+
+  bool write(string_view data) override
+  {
+    if (buffer.size() + data.size() > (1 << 16) && !flush())
+      return false;
+    if (data.size() >= (1 << 16))
+    {
+      ok = write_all(fd, data.data(), data.size());
+      return ok;
+    }
+    buffer.append(data);
+    return true;
+  }
+
+  void finish() override
+  {
+    flush();
+  }
+
+private:
+  bool flush()
+  {
+    if (ok && !buffer.empty())
+      ok = write_all(fd, buffer.data(), buffer.size());
+    buffer.clear();
+    return ok;
+  }
+
+  int fd;
+  bool ok = true;
+  string buffer;
+};
+
+class CatFilter : public Filter
+{
+public:
+  bool write(string_view data) override
+  {
+    return emit(data);
+  }
+};
+
+class HeadFilter : public Filter
+{
+public:
+  explicit HeadFilter(long lines) : remaining(lines) {}
+
+  bool write(string_view data) override
+  {
+    const char *p = data.data();
+    const char *end = p + data.size();
+    while (remaining > 0)
+    {
+      const char *nl = (const char *)memchr(p, '\n', end - p);
+      if (!nl)
+        return emit(data);
+      p = nl + 1;
+      remaining--;
+    }
+    emit(data.substr(0, p - data.data()));
+    return false;
+  }
+
+private:
+  long remaining;
+};
+
+class WcFilter : public Filter
+{
+public:
+  WcFilter(char unit, string label) : unit(unit), label(move(label)) {}
+
+  bool write(string_view data) override
+  {
+    if (unit == 'l')
+      count += count_newlines(data.data(), data.size());
+    else if (unit == 'c')
+      count += data.size();
+    else
+    {
+      for (char ch : data)
+      {
+        bool space = ch == ' ' || (ch >= '\t' && ch <= '\r');
+        if (!space && !in_word)
+          count++;
+        in_word = !space;
+      }
+    }
+    return true;
+  }
+
+  void finish() override
+  {
+    emit(to_string(count) + (label.empty() ? "" : " " + label) + "\n");
+    Filter::finish();
+  }
+
+private:
+  char unit;
+  string label;
+  size_t count = 0;
+  bool in_word = false;
+};
+
+// Line selection with a fixed string. Complete lines are searched a block at
+// a time with find_substring; a line split across two writes is carried over.
+class GrepFilter : public Filter
+{
+public:
+  GrepFilter(string pattern, bool invert, bool count_only)
+      : pattern(move(pattern)), invert(invert), count_only(count_only) {}
+
+  bool write(string_view data) override
+  {
+    if (!partial.empty())
+    {
+      const char *nl = (const char *)memchr(data.data(), '\n', data.size());
+      if (!nl)
+      {
+        partial.append(data);
+        return true;
+      }
+      size_t used = nl + 1 - data.data();
+      partial.append(data.substr(0, used));
+      bool more = select_lines(partial);
+      partial.clear();
+      data.remove_prefix(used);
+      if (!more)
+        return false;
+    }
+    const char *last_nl = (const char *)memrchr(data.data(), '\n', data.size());
+    size_t complete = last_nl ? last_nl + 1 - data.data() : 0;
+    partial.assign(data.substr(complete));
+    return select_lines(data.substr(0, complete));
+  }
+
+  void finish() override
+  {
+    if (!partial.empty())
+    {
+      partial.push_back('\n');
+      select_lines(partial);
+    }
+    if (count_only)
+      emit(to_string(selected) + "\n");
+    Filter::finish();
+  }
+
+  size_t selected = 0;
+
+private:
+  // block holds whole lines, each ending in '\n'.
+  bool select_lines(string_view block)
+  {
+    size_t pos = 0;
+    while (pos < block.size())
+    {
+      const char *hit = find_substring(block.data() + pos, block.size() - pos, pattern);
+      if (!hit)
+        return !invert || take(block.substr(pos));
+      const char *line_start = (const char *)memrchr(block.data() + pos, '\n', hit - (block.data() + pos));
+      size_t start = line_start ? line_start + 1 - block.data() : pos;
+      size_t end = (const char *)memchr(hit, '\n', block.data() + block.size() - hit) + 1 - block.data();
+      if (!take(invert ? block.substr(pos, start - pos) : block.substr(start, end - start)))
+        return false;
+      pos = end;
+    }
+    return true;
+  }
+
+  bool take(string_view lines)
+  {
+    if (lines.empty())
+      return true;
+    selected += invert ? count_newlines(lines.data(), lines.size()) : 1;
+    return count_only || emit(lines);
+  }
+
+  string pattern;
+  bool invert;
+  bool count_only;
+  string partial;
+};
+
+// Runs specs as one fused chain writing to out_fd; input comes from in_fd
+// unless a stage names files, and errors about those files go to err_fd.
+// Returns the exit status of the last stage.
+static int run_filter_chain(const vector<FilterSpec> &specs, int in_fd, int out_fd, int err_fd)
+{
+  TraceScope trace("filters", specs.front().cmd);
+  // Only the first stage of a chain can have file operands.
+  vector<unique_ptr<Filter>> chain;
+  GrepFilter *last_grep = nullptr;
+  for (size_t k = 0; k < specs.size(); k++)
+  {
+    const FilterSpec &spec = specs[k];
+    if (spec.cmd == "cat")
+      chain.push_back(make_unique<CatFilter>());
+    else if (spec.cmd == "head")
+      chain.push_back(make_unique<HeadFilter>(spec.lines));
+    else if (spec.cmd == "wc")
+      chain.push_back(make_unique<WcFilter>(spec.unit, spec.files.empty() ? "" : spec.files[0]));
+    else
+    {
+      auto grep = make_unique<GrepFilter>(spec.pattern, spec.invert, spec.count_only);
+      last_grep = k == specs.size() - 1 ? grep.get() : nullptr;
+      chain.push_back(move(grep));
+    }
+  }
+  FdSink sink(out_fd);
+  for (size_t k = 0; k < chain.size(); k++)
+  {
+    chain[k]->next = k + 1 < chain.size() ? chain[k + 1].get() : &sink;
+  }
+
+  Filter &first = *chain.front();
+  const FilterSpec &source = specs.front();
+  int status = 0;
+  if (source.files.empty())
+  {
+    vector<char> buf(1 << 16);
+    ssize_t got;
+    while ((got = read(in_fd, buf.data(), buf.size())) > 0 || (got < 0 && errno == EINTR))
+    {
+      if (got > 0 && !first.write(string_view(buf.data(), got)))
+        break;
+    }
+  }
+  for (const string &file : source.files)
+  {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || S_ISDIR(st.st_mode))
+    {
+      string error = source.cmd + ": " + file + ": " + (fd < 0 ? strerror(errno) : "Is a directory") + "\n";
+      write_all(err_fd, error.data(), error.size());
+      status = source.cmd == "grep" ? 2 : 1;
+      if (fd >= 0)
+        close(fd);
+      continue;
+    }
+    bool more = true;
+    if (st.st_size > 0)
+    {
+      void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+      {
+        // Fed in 1 MiB pieces, each prefaulted in one call, so a chain that
+        // stops early (head) never touches the rest of the file.
+        const size_t piece = 1 << 20;
+        for (size_t off = 0; more && off < (size_t)st.st_size; off += piece)
+        {
+          size_t len = min(piece, st.st_size - off);
+#ifdef MADV_POPULATE_READ
+          madvise((char *)map + off, len, MADV_POPULATE_READ);
+#endif
+          more = first.write(string_view((const char *)map + off, len));
+        }
+        munmap(map, st.st_size);
+      }
+    }
+    close(fd);
+    if (!more)
+      break;
+  }
+  // A pipeline's status is its last stage's, so a missing file only counts
+  // when the stage reading it ends the chain.
+  first.finish();
+  if (specs.size() != 1)
+    status = 0;
+  if (last_grep && status == 0)
+    status = last_grep->selected ? 0 : 1;
+  return status;
+}
+
+static bool redirects_input(const SimpleCommand &command)
+{
+  return any_of(command.redirs.begin(), command.redirs.end(), [](const Redirection &r)
+                { return r.fd == STDIN_FILENO; });
+}
+
+// A lone filter only runs in the shell when it reads files; reading the
+// terminal is left to the real binary.
+static bool runs_in_shell(const SimpleCommand &command)
+{
+  if (!filters_enabled() || is_builtin(string(command.words[0])) || redirects_input(command))
+    return false;
+  auto spec = parse_filter(command);
+  return spec && !spec->files.empty();
+}
+
+// Opens a redirection target for a child process. The descriptor is
+// close-on-exec; it only survives into the child through a dup2 action.
+int open_redirect(const char *file, bool append)
+{
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+  int fd = open(file, flags, 0644);
+  if (fd < 0)
+  {
+    perror("open");
+  }
+  return fd;
+}
+
+// The text a here-document or here-string delivers. A here-document whose
+// delimiter was unquoted gets its parameters expanded now, as it runs, with
+// \$, \\ and \` standing for themselves; anything else is the text itself.
+static string_view here_text(const Redirection &r, string &storage)
+{
+  string_view body = r.file;
+  if (r.here != HereKind::Document || body.find_first_of("$\\") == string_view::npos)
+    return body;
+  storage.clear();
+  storage.reserve(body.size());
+  for (size_t i = 0; i < body.size(); i++)
+  {
+    char ch = body[i];
+    if (ch == '\\' && i + 1 < body.size() && strchr("$\\`", body[i + 1]))
+    {
+      storage.push_back(body[++i]);
+      continue;
+    }
+    string number;
+    const char *value;
+    if (ch == '$' && read_parameter(body, i, number, value))
+    {
+      if (value)
+        storage.append(value);
+      continue;
+    }
+    storage.push_back(ch);
+  }
+  return storage;
+}
+
+// Delivers here text as the read end of a pipe when it fits in the pipe's
+// buffer (it is written whole before the command starts), otherwise as a
+// memfd, so nothing is written to the filesystem.
+static int here_fd(string_view text, bool newline)
+{
+  size_t len = text.size() + newline;
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == 0)
+  {
+    if ((long)len <= fcntl(fds[1], F_GETPIPE_SZ))
+    {
+      write_all(fds[1], text.data(), text.size());
+      if (newline)
+        write_all(fds[1], "\n", 1);
+      close(fds[1]);
+      return fds[0];
+    }
+    close(fds[0]);
+    close(fds[1]);
+  }
+  int fd = memfd_create("here-document", MFD_CLOEXEC);
+  if (fd < 0)
+  {
+    perror("memfd_create");
+    return -1;
+  }
+  if (!write_all(fd, text.data(), text.size()) || (newline && !write_all(fd, "\n", 1)))
+  {
+    perror("write");
+    close(fd);
+    return -1;
+  }
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+// Opens a command's stdin redirection: a file, or here text.
+static int open_input(const Redirection &r)
+{
+  if (r.here == HereKind::None)
+  {
+    int fd = open(r.file.data(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      perror(r.file.data());
+    return fd;
+  }
+  string storage;
+  return here_fd(here_text(r, storage), r.here == HereKind::String);
+}
+
+vector<string> builtin_args(const SimpleCommand &c)
+{
+  return vector<string>(c.words.begin() + 1, c.words.end());
+}
+
+// How a command's stdin, stdout and stderr are wired. stdin takes the last of
+// its redirections. An output stream with a single target is dup2'd onto it
+// directly; one with several (e.g. "> a >> b", or "> a" on a stage that also
+// feeds a pipe) is pointed at a feed pipe drained by a fan_out pump thread.
+// "N>&M" points N at whatever M is at that point of the redirections, so
+// "> f 2>&1" sends both to f and "2>&1 > f" sends stderr where stdout was.
+struct OutputPlan
+{
+  vector<pair<int, int>> fds; // (from, to) pairs to install in the command
+  vector<int> owned;          // the shell's copies, closed once the command has them
+  vector<thread> pumps;
+  bool failed = false; // stdin's redirection could not be opened: don't run
+};
+
+// Where an output stream goes: every file in `files`, and, unless `base` is
+// -1, the default destination of descriptor `base` (the pipe to the next
+// stage for stdout, otherwise the shell's own descriptor).
+struct OutputDest
+{
+  vector<const Redirection *> files;
+  int base;
+};
+
+OutputPlan plan_outputs(const vector<Redirection> &redirs, int pipe_out)
+{
+  TraceScope trace("redirect");
+  OutputPlan plan;
+  int in_fd = -1;
+  for (const auto &r : redirs)
+  {
+    // Once one stdin redirection has failed the command does not run, so
+    // the rest are not even opened.
+    if (r.fd != STDIN_FILENO || plan.failed)
+      continue;
+    if (in_fd != -1)
+      close(in_fd);
+    if (r.dup)
+    {
+      in_fd = fcntl(atoi(r.file.data()), F_DUPFD_CLOEXEC, 0);
+      if (in_fd == -1)
+        cerr << r.file << ": " << strerror(errno) << "\n";
+    }
+    else
+      in_fd = open_input(r);
+    plan.failed = in_fd == -1;
+  }
+  if (in_fd != -1)
+  {
+    plan.fds.emplace_back(in_fd, STDIN_FILENO);
+    plan.owned.push_back(in_fd);
+  }
+
+  OutputDest dests[3] = {{{}, STDIN_FILENO}, {{}, STDOUT_FILENO}, {{}, STDERR_FILENO}};
+  for (const auto &r : redirs)
+  {
+    if (r.fd == STDIN_FILENO)
+      continue;
+    OutputDest &dest = dests[r.fd];
+    if (r.dup)
+    {
+      int from = atoi(r.file.data());
+      dest = from >= 0 && from <= STDERR_FILENO ? dests[from] : OutputDest{{}, from};
+      continue;
+    }
+    // Output to a pipe keeps going there as well (see above).
+    if (!(r.fd == STDOUT_FILENO && pipe_out != -1 && dest.base == STDOUT_FILENO))
+      dest.base = -1;
+    dest.files.push_back(&r);
+  }
+  // Each file is opened once, so streams sent to the same one share its
+  // offset. The first stream to use a descriptor takes it, later ones get a
+  // copy, and the ones nobody took are closed with the plan.
+  map<const Redirection *, pair<int, bool>> opened; // fd, taken
+  for (int target : {STDOUT_FILENO, STDERR_FILENO})
+  {
+    for (const auto *r : dests[target].files)
+    {
+      opened.emplace(r, make_pair(-1, false));
+    }
+  }
+  for (auto &[r, fd] : opened)
+  {
+    bool fanned = false;
+    for (int target : {STDOUT_FILENO, STDERR_FILENO})
+    {
+      const OutputDest &dest = dests[target];
+      bool uses = find(dest.files.begin(), dest.files.end(), r) != dest.files.end();
+      fanned = fanned || (uses && dest.files.size() + (dest.base != -1) > 1);
+    }
+    fd.first = fanned ? open_fan_out_sink(r->file.data(), r->append) : open_redirect(r->file.data(), r->append);
+    if (fd.first < 0 && fanned)
+      perror("open");
+  }
+  pair<int, bool> pipe = {pipe_out, false};
+  auto take = [](pair<int, bool> &fd)
+  {
+    if (fd.second)
+      return fcntl(fd.first, F_DUPFD_CLOEXEC, 0);
+    fd.second = true;
+    return fd.first;
+  };
+
+  for (int target : {STDOUT_FILENO, STDERR_FILENO})
+  {
+    const OutputDest &dest = dests[target];
+    bool to_pipe = dest.base == STDOUT_FILENO && pipe_out != -1;
+    // Nothing to install when the stream keeps the shell's own descriptor.
+    if (dest.files.empty() && dest.base == target && !to_pipe)
+      continue;
+    vector<int> sinks;
+    for (const auto *r : dest.files)
+    {
+      auto &fd = opened[r];
+      if (fd.first >= 0)
+        sinks.push_back(take(fd));
+    }
+    if (dest.base != -1)
+    {
+      int fd = to_pipe ? take(pipe) : fcntl(dest.base, F_DUPFD_CLOEXEC, 0);
+      if (fd < 0)
+        cerr << dest.base << ": " << strerror(errno) << "\n";
+      else
+        sinks.push_back(fd);
+    }
+    if (sinks.empty())
+      continue;
+    if (sinks.size() == 1)
+    {
+      plan.fds.emplace_back(sinks[0], target);
+      plan.owned.push_back(sinks[0]);
+      continue;
+    }
+    int feed[2];
+    if (pipe2(feed, O_CLOEXEC) != 0)
+    {
+      perror("pipe");
+      for (int fd : sinks)
+      {
+        close(fd);
+      }
+      continue;
+    }
+    plan.fds.emplace_back(feed[1], target);
+    plan.owned.push_back(feed[1]);
+    plan.pumps.emplace_back([in = feed[0], sinks]()
+                            {
+      fan_out(in, sinks);
+      close(in);
+      for (int fd : sinks)
+      {
+        close(fd);
+      } });
+  }
+  for (auto &[r, fd] : opened)
+  {
+    if (fd.first >= 0 && !fd.second)
+      plan.owned.push_back(fd.first);
+  }
+  if (pipe_out != -1 && !pipe.second)
+    plan.owned.push_back(pipe_out);
+  return plan;
+}
+
+int plan_target(const OutputPlan &plan, int target)
+{
+  for (const auto &fd : plan.fds)
+  {
+    if (fd.second == target)
+      return fd.first;
+  }
+  return -1;
+}
+
+void close_fds(const vector<int> &fds)
+{
+  for (int fd : fds)
+  {
+    close(fd);
+  }
+}
+
+void join_pumps(OutputPlan &plan)
+{
+  for (auto &t : plan.pumps)
+  {
+    t.join();
+  }
+  plan.pumps.clear();
+}
+
+// Launches an external command with posix_spawn. glibc implements it with
+// clone(CLONE_VM | CLONE_VFORK), so the shell's page tables (readline state,
+// history) are never copied the way fork() would. fds holds (from, to) pairs
+// installed in the child with dup2; everything else the shell opens for
+// children is O_CLOEXEC, so no close actions are needed. With the spawn
+// helper in use the request goes there instead, falling back to posix_spawn
+// here if the helper is gone.
+pid_t spawn_command(const string &path, const vector<string_view> &argv, const vector<pair<int, int>> &fds, pid_t pgid)
+{
+  TraceScope trace("spawn", path);
+  if (helper_in_use)
+  {
+    int err;
+    pid_t pid = helper_spawn(path, argv, fds, pgid, err);
+    if (pid > 0)
+      return pid;
+    if (err != 0)
+    {
+      cerr << "Failed to execute " << argv[0] << ": " << strerror(err) << "\n";
+      return -1;
+    }
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  for (const auto &fd : fds)
+  {
+    posix_spawn_file_actions_adddup2(&actions, fd.first, fd.second);
+  }
+  // The shell ignores SIGPIPE (for its builtin threads) and the job control
+  // stop signals, and blocks SIGCHLD; children get the defaults back.
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  for (int sig : {SIGPIPE, SIGTSTP, SIGTTIN, SIGTTOU})
+  {
+    sigaddset(&defaults, sig);
+  }
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  sigset_t mask;
+  sigemptyset(&mask);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+  if (pgid >= 0)
+  {
+    posix_spawnattr_setpgroup(&attr, pgid);
+    flags |= POSIX_SPAWN_SETPGROUP;
+  }
+  posix_spawnattr_setflags(&attr, flags);
+  vector<char *> cargv = to_char_ptr_vec(argv);
+  pid_t pid;
+  int err = posix_spawn(&pid, path.c_str(), &actions, &attr, cargv.data(), shell_envp());
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (err != 0)
+  {
+    cerr << "Failed to execute " << argv[0] << ": " << strerror(err) << "\n";
+    return -1;
+  }
+  return pid;
+}
+
+// CPU placement for pipeline stages (SHELL_PIPELINE_AFFINITY=1). The CPUs the
+// shell may run on are ordered from the topology in /sys/devices/system/cpu
+// so that neighbours share the most cache: grouped by L3, then by L2, with
+// one hardware thread of every core before any SMT sibling. Each process
+// stage of a pipeline is pinned to the next CPU in that order, so a producer
+// and its consumer sit on different cores sharing L2 or L3.
+struct CpuPlace
+{
+  int cpu;
+  int l3 = -1;     // lowest CPU sharing its L3
+  int l2 = -1;     // lowest CPU sharing its L2
+  int thread = 0;  // position among its core's SMT siblings
+};
+
+static vector<int> parse_cpu_list(const string &list)
+{
+  vector<int> cpus;
+  const char *p = list.c_str();
+  while (isdigit((unsigned char)*p))
+  {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    for (long cpu = first; cpu <= last; cpu++)
+    {
+      cpus.push_back(cpu);
+    }
+    p = *end == ',' ? end + 1 : end;
+  }
+  return cpus;
+}
+
+static string read_first_line(const string &path)
+{
+  ifstream in(path);
+  string line;
+  getline(in, line);
+  return line;
+}
+
+// CPUs grouped by L3 domain, each in placement order; empty when there is
+// nothing to place on (fewer than two usable CPUs).
+static const vector<vector<int>> &cpu_domains()
+{
+  static vector<vector<int>> domains;
+  static bool loaded = false;
+  if (loaded)
+    return domains;
+  loaded = true;
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) < 2)
+    return domains;
+  vector<CpuPlace> places;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+  {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+    string base = "/sys/devices/system/cpu/cpu" + to_string(cpu);
+    CpuPlace place{cpu};
+    for (int index = 0;; index++)
+    {
+      string cache = base + "/cache/index" + to_string(index);
+      string level = read_first_line(cache + "/level");
+      if (level.empty())
+        break;
+      vector<int> shared = parse_cpu_list(read_first_line(cache + "/shared_cpu_list"));
+      int lowest = shared.empty() ? cpu : shared.front();
+      if (level == "2")
+        place.l2 = lowest;
+      else if (level == "3")
+        place.l3 = lowest;
+    }
+    vector<int> siblings = parse_cpu_list(read_first_line(base + "/topology/thread_siblings_list"));
+    place.thread = find(siblings.begin(), siblings.end(), cpu) - siblings.begin();
+    if (place.thread == (int)siblings.size())
+      place.thread = 0;
+    places.push_back(place);
+  }
+  sort(places.begin(), places.end(), [](const CpuPlace &a, const CpuPlace &b)
+       { return tie(a.l3, a.thread, a.l2, a.cpu) < tie(b.l3, b.thread, b.l2, b.cpu); });
+  for (size_t i = 0; i < places.size(); i++)
+  {
+    if (i == 0 || places[i].l3 != places[i - 1].l3)
+      domains.emplace_back();
+    domains.back().push_back(places[i].cpu);
+  }
+  return domains;
+}
+
+static bool affinity_enabled()
+{
+  const char *setting = variable_value("SHELL_PIPELINE_AFFINITY");
+  return setting && strcmp(setting, "1") == 0;
+}
+
+// One CPU per stage for an n-stage pipeline, or nothing when placement is off.
+// Successive pipelines take L3 domains in turn; a pipeline longer than any
+// domain is laid out over all of them.
+static vector<int> pipeline_placement(int n)
+{
+  static size_t next_domain = 0;
+  if (n < 2 || !affinity_enabled())
+    return {};
+  const auto &domains = cpu_domains();
+  if (domains.empty())
+    return {};
+  vector<int> cpus;
+  for (size_t k = 0; k < domains.size() && cpus.empty(); k++)
+  {
+    const auto &domain = domains[(next_domain + k) % domains.size()];
+    if ((int)domain.size() >= n)
+      cpus = domain;
+  }
+  next_domain++;
+  if (cpus.empty())
+  {
+    for (const auto &domain : domains)
+    {
+      cpus.insert(cpus.end(), domain.begin(), domain.end());
+    }
+  }
+  vector<int> placement(n);
+  for (int i = 0; i < n; i++)
+  {
+    placement[i] = cpus[i % cpus.size()];
+  }
+  return placement;
+}
+
+// posix_spawn runs no code of ours in the child, so the stage is pinned right
+// after it starts.
+static void pin_process(pid_t pid, int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(pid, sizeof(set), &set) < 0 && errno != ESRCH)
+    perror("sched_setaffinity");
+}
+
+// Pipe capacity for pipelines, set by SHELL_PIPE_SIZE: a size in bytes (with
+// an optional K or M suffix) applied to every pipe with F_SETPIPE_SZ, or
+// "adaptive". Adaptive pipelines start at the default capacity; a pipe found
+// full in at least half the samples taken while its pipeline ran in the
+// foreground is made four times larger on later runs of the same commands.
+// Sizes are capped at /proc/sys/fs/pipe-max-size.
+struct PipeSizing
+{
+  vector<int> capacity; // per pipe, indexed by the writing stage; 0: default
+  bool adaptive = false;
+  string signature; // the stages' command names
+};
+
+static unordered_map<string, vector<int>> pipe_profiles; // adaptive, by signature
+
+static int pipe_max_size()
+{
+  static int max_size = 0;
+  if (max_size == 0)
+  {
+    max_size = atoi(read_first_line("/proc/sys/fs/pipe-max-size").c_str());
+    if (max_size <= 0)
+      max_size = 1 << 20;
+  }
+  return max_size;
+}
+
+static long parse_size(const string &text)
+{
+  char *end;
+  long size = strtol(text.c_str(), &end, 10);
+  if (end == text.c_str() || size <= 0)
+    return 0;
+  if (*end == 'k' || *end == 'K')
+    size <<= 10;
+  else if (*end == 'm' || *end == 'M')
+    size <<= 20;
+  else
+    return *end ? 0 : size;
+  return end[1] ? 0 : size;
+}
+
+static PipeSizing pipe_sizing(const Pipeline &pipeline)
+{
+  PipeSizing sizing;
+  int n = pipeline.stages.size();
+  sizing.capacity.assign(n, 0);
+  const char *setting = variable_value("SHELL_PIPE_SIZE");
+  if (!setting || n < 2)
+    return sizing;
+  if (strcmp(setting, "adaptive") == 0)
+  {
+    sizing.adaptive = true;
+    for (const auto &stage : pipeline.stages)
+    {
+      sizing.signature.append(stage.words[0]).push_back('|');
+    }
+    auto it = pipe_profiles.find(sizing.signature);
+    if (it != pipe_profiles.end())
+      sizing.capacity = it->second;
+    return sizing;
+  }
+  long size = min<long>(parse_size(setting), pipe_max_size());
+  sizing.capacity.assign(n, size);
+  return sizing;
+}
+
+// Grows the pipes of an adaptive pipeline that kept filling up.
+static void learn_pipe_sizes(const PipeSizing &sizing, const Job &job)
+{
+  vector<int> capacity = sizing.capacity;
+  bool grew = false;
+  for (const auto &w : job.pipe_watch)
+  {
+    if (w.samples < 3 || w.full * 2 < w.samples)
+      continue;
+    int current = capacity[w.pipe] > 0 ? capacity[w.pipe] : 65536;
+    int next = min(current * 4, pipe_max_size());
+    if (next > current)
+    {
+      capacity[w.pipe] = next;
+      grew = true;
+    }
+  }
+  if (!grew)
+    return;
+  if (pipe_profiles.size() >= 256 && !pipe_profiles.count(sizing.signature))
+    pipe_profiles.clear();
+  pipe_profiles[sizing.signature] = move(capacity);
+}
+
+// Resource usage of one stage, for the `time` keyword. Builtins that ran on a
+// shell thread report that thread's CPU time and no max RSS.
+struct StageUsage
+{
+  string command;
+  double real = 0;
+  struct rusage usage = {};
+  bool in_shell = false;
+};
+
+static double tv_seconds(const struct timeval &tv)
+{
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static string format_duration(double seconds)
+{
+  ostringstream out;
+  int minutes = (int)(seconds / 60);
+  out << minutes << "m" << fixed << setprecision(3) << seconds - minutes * 60 << "s";
+  return out.str();
+}
+
+// Thread CPU usage between two getrusage(RUSAGE_THREAD) samples.
+StageUsage thread_usage_since(const struct rusage &before, double started)
+{
+  StageUsage u;
+  struct rusage after;
+  getrusage(RUSAGE_THREAD, &after);
+  u.real = monotonic_seconds() - started;
+  timersub(&after.ru_utime, &before.ru_utime, &u.usage.ru_utime);
+  timersub(&after.ru_stime, &before.ru_stime, &u.usage.ru_stime);
+  u.usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+  u.usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+  u.in_shell = true;
+  return u;
+}
+
+// Prints bash-style totals to stderr, plus a per-stage table for pipelines.
+void report_time(double real, const vector<StageUsage> &stages)
+{
+  double user = 0, sys = 0;
+  long maxrss = 0, nvcsw = 0, nivcsw = 0;
+  bool any_process = false;
+  for (const auto &st : stages)
+  {
+    any_process = any_process || !st.in_shell;
+    user += tv_seconds(st.usage.ru_utime);
+    sys += tv_seconds(st.usage.ru_stime);
+    maxrss = max(maxrss, st.usage.ru_maxrss);
+    nvcsw += st.usage.ru_nvcsw;
+    nivcsw += st.usage.ru_nivcsw;
+  }
+  ostringstream out;
+  out << "\nreal\t" << format_duration(real) << "\n"
+      << "user\t" << format_duration(user) << "\n"
+      << "sys\t" << format_duration(sys) << "\n"
+      << "maxrss\t" << (any_process ? to_string(maxrss) + " KiB" : string("-")) << "\n"
+      << "ctxsw\t" << nvcsw << " voluntary, " << nivcsw << " involuntary\n";
+  if (stages.size() > 1)
+  {
+    out << "\n"
+        << setw(3) << "#" << setw(10) << "real" << setw(10) << "user" << setw(10) << "sys"
+        << setw(12) << "maxrss" << setw(8) << "vcsw" << setw(8) << "ivcsw" << "  command\n";
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+      const StageUsage &st = stages[i];
+      out << setw(3) << i + 1 << fixed << setprecision(3)
+          << setw(9) << st.real << "s"
+          << setw(9) << tv_seconds(st.usage.ru_utime) << "s"
+          << setw(9) << tv_seconds(st.usage.ru_stime) << "s"
+          << setw(12) << (st.in_shell ? string("-") : to_string(st.usage.ru_maxrss) + " KiB")
+          << setw(8) << st.usage.ru_nvcsw << setw(8) << st.usage.ru_nivcsw
+          << "  " << st.command << (st.in_shell ? " (builtin)" : "") << "\n";
+    }
+  }
+  cerr << out.str();
+}
+
+string job_text(const Pipeline &pipeline)
+{
+  string text;
+  for (const auto &stage : pipeline.stages)
+  {
+    if (!text.empty())
+      text += " | ";
+    for (size_t i = 0; i < stage.words.size(); i++)
+    {
+      text += (i ? " " : "") + string(stage.words[i]);
+    }
+    for (const auto &r : stage.redirs)
+    {
+      if (r.here == HereKind::String)
+        text += " <<< " + string(r.file);
+      else if (r.here != HereKind::None)
+        text += " << (here-document)";
+      else if (r.dup)
+        text += " " + to_string(r.fd) + (r.fd == STDIN_FILENO ? "<&" : ">&") + string(r.file);
+      else if (r.fd == STDIN_FILENO)
+        text += " < " + string(r.file);
+      else
+        text += string(r.fd == STDERR_FILENO ? " 2" : " ") + (r.append ? ">> " : "> ") + string(r.file);
+    }
+  }
+  return text;
+}
+
+// Runs a pipeline (of one or more stages) as a job; returns the status of the
+// last stage, or 0 for a background job.
+int handle_pipeline_n(const Pipeline &pipeline, bool background)
+{
+  TraceScope trace("pipeline");
+  int n = pipeline.stages.size();
+  int prev_fd = STDIN_FILENO;
+  vector<thread> builtin_threads;
+  vector<OutputPlan> plans;
+  Job job;
+  job.text = job_text(pipeline);
+  double started = monotonic_seconds();
+  // Builtin threads fill their slot; shared because threads of a background or
+  // stopped job outlive this call.
+  auto thread_usage = make_shared<vector<StageUsage>>(n);
+
+  // Runs of adjacent in-process filters. A run ends at a stage with its own
+  // redirections and before a stage with file operands (which ignores its
+  // input, but the stages before it must still run and report errors). The
+  // run's last stage runs the whole fused chain; the other stages of the run
+  // are skipped. A run that would read the shell's stdin is handed to the
+  // real binaries instead.
+  vector<optional<FilterSpec>> filters(n);
+  vector<int> run_start(n, -1);
+  if (filters_enabled())
+  {
+    for (int i = 0; i < n; i++)
+    {
+      if (!is_builtin(string(pipeline.stages[i].words[0])) && !redirects_input(pipeline.stages[i]))
+        filters[i] = parse_filter(pipeline.stages[i]);
+    }
+    for (int i = 0; i < n;)
+    {
+      if (!filters[i])
+      {
+        i++;
+        continue;
+      }
+      int j = i;
+      while (j + 1 < n && filters[j + 1] && filters[j + 1]->files.empty() && pipeline.stages[j].redirs.empty())
+        j++;
+      if (i == 0 && filters[i]->files.empty())
+      {
+        filters[i].reset();
+        i++;
+        continue;
+      }
+      run_start[j] = i;
+      i = j + 1;
+    }
+  }
+  // Status of a last stage that runs on a helper thread (a filter chain or
+  // tee), known only once the thread finishes.
+  auto thread_status = make_shared<int>(0);
+  bool last_on_thread = false;
+
+  // Resolve in the parent so lookups land in (and are served from) the shell's
+  // command hash table rather than a throwaway copy in each child.
+  vector<optional<string>> paths(n);
+  for (int i = 0; i < n; i++)
+  {
+    string cmd(pipeline.stages[i].words[0]);
+    if (!is_builtin(cmd) && !filters[i])
+      paths[i] = find_in_path(cmd);
+  }
+  vector<int> placement = pipeline_placement(n);
+  PipeSizing sizing = pipe_sizing(pipeline);
+  int prev_pipe = -1; // the stage that wrote prev_fd
+
+  for (int i = 0; i < n; i++)
+  {
+    // Fused into the filter run that ends at a later stage.
+    if (filters[i] && run_start[i] == -1)
+    {
+      (*thread_usage)[i].in_shell = true;
+      continue;
+    }
+    const SimpleCommand &stage = pipeline.stages[i];
+    int pipefd[2];
+    if (i != n - 1)
+    {
+      pipe2(pipefd, O_CLOEXEC);
+      if (sizing.capacity[i] > 0)
+        fcntl(pipefd[1], F_SETPIPE_SZ, sizing.capacity[i]);
+    }
+
+    // The plan takes over the pipe's write end: it is either dup2'd into the
+    // stage or becomes one of the stage's fan-out sinks.
+    plans.push_back(plan_outputs(stage.redirs, i != n - 1 ? pipefd[1] : -1));
+    OutputPlan &plan = plans.back();
+    string cmd(stage.words[0]);
+
+    bool input_taken = false;
+    if (plan.failed)
+    {
+      close_fds(plan.owned);
+      if (i == n - 1)
+        job.status = 1;
+    }
+    else if (paths[i])
+    {
+      vector<pair<int, int>> fds = plan.fds;
+      if (prev_fd != STDIN_FILENO)
+        fds.emplace(fds.begin(), prev_fd, STDIN_FILENO);
+      pid_t pid = spawn_command(*paths[i], stage.words, fds, job_control ? job.pgid : -1);
+      close_fds(plan.owned);
+      if (pid > 0 && !placement.empty())
+        pin_process(pid, placement[i]);
+      if (pid > 0 && sizing.adaptive && !background && prev_pipe != -1)
+        job.pipe_watch.push_back({pid, prev_pipe});
+      if (pid > 0)
+      {
+        if (job.pgid == 0)
+          job.pgid = pid;
+        job.procs.push_back({pid, i});
+      }
+      if (i == n - 1)
+      {
+        job.last_is_process = pid > 0;
+        job.status = pid > 0 ? 0 : 126;
+      }
+    }
+    else if (run_start[i] != -1)
+    {
+      // Only the run's first stage reads files, and only the last one can
+      // have redirections; the errors go to the first stage's stderr.
+      int out_fd = plan_target(plan, STDOUT_FILENO);
+      int err_fd = run_start[i] == i ? plan_target(plan, STDERR_FILENO) : -1;
+      int in_fd = prev_fd != STDIN_FILENO ? prev_fd : -1;
+      input_taken = true;
+      vector<FilterSpec> specs;
+      for (int k = run_start[i]; k <= i; k++)
+      {
+        specs.push_back(*filters[k]);
+      }
+      bool last = i == n - 1;
+      builtin_threads.emplace_back([specs = move(specs), in_fd, out_fd, err_fd, owned = plan.owned, thread_usage, i, started, last, thread_status]()
+                                   {
+        struct rusage before;
+        getrusage(RUSAGE_THREAD, &before);
+        int status = run_filter_chain(specs, in_fd, out_fd == -1 ? STDOUT_FILENO : out_fd,
+                                      err_fd == -1 ? STDERR_FILENO : err_fd);
+        if (last)
+          *thread_status = status;
+        if (in_fd != -1)
+          close(in_fd);
+        close_fds(owned);
+        (*thread_usage)[i] = thread_usage_since(before, started); });
+      if (last)
+        last_on_thread = true;
+    }
+    else if (is_builtin(cmd))
+    {
+      // Builtins run in-process on a helper thread that owns the stage's
+      // output descriptors. Only tee reads stdin; the rest produce their
+      // output here on the main thread, while shell state (history, hash
+      // table, jobs) is safe to read, and the thread just writes it out. For
+      // those prev_fd is simply closed.
+      int out_fd = plan_target(plan, STDOUT_FILENO);
+      int in_fd = -1;
+      int redirected_in = plan_target(plan, STDIN_FILENO);
+      if (cmd == "tee" && redirected_in != -1)
+      {
+        in_fd = fcntl(redirected_in, F_DUPFD_CLOEXEC, 0);
+      }
+      else if (cmd == "tee" && prev_fd != STDIN_FILENO)
+      {
+        in_fd = prev_fd;
+        input_taken = true;
+      }
+      vector<string> args = builtin_args(stage);
+      string output;
+      bool last = i == n - 1;
+      if (cmd != "tee")
+      {
+        ostringstream out;
+        int status = run_builtin(cmd, args, out, true);
+        output = move(out).str();
+        if (last)
+          job.status = status;
+      }
+      else if (last)
+        last_on_thread = true;
+      builtin_threads.emplace_back([cmd, args = move(args), output = move(output), out_fd, in_fd, owned = plan.owned, thread_usage, i, started, last, thread_status]()
+                                   {
+        struct rusage before;
+        getrusage(RUSAGE_THREAD, &before);
+        if (cmd == "tee")
+        {
+          int status = builtin_tee(args, in_fd == -1 ? STDIN_FILENO : in_fd, out_fd == -1 ? STDOUT_FILENO : out_fd);
+          if (last)
+            *thread_status = status;
+        }
+        else
+          write_all(out_fd == -1 ? STDOUT_FILENO : out_fd, output.data(), output.size());
+        if (in_fd != -1)
+          close(in_fd);
+        close_fds(owned);
+        (*thread_usage)[i] = thread_usage_since(before, started); });
+    }
+    else
+    {
+      close_fds(plan.owned);
+      if (i == n - 1)
+        job.status = 127;
+    }
+
+    if (prev_fd != STDIN_FILENO && !input_taken)
+      close(prev_fd);
+
+    if (i != n - 1)
+    {
+      prev_fd = pipefd[0];
+      prev_pipe = i;
+    }
+  }
+  int status = 0;
+  bool detach = background;
+  if (background)
+  {
+    if (!job.procs.empty())
+    {
+      Job &added = add_job(move(job));
+      if (job_control)
+        cout << "[" << added.id << "] " << added.procs.back().pid << "\n";
+    }
+  }
+  else
+  {
+    status = wait_foreground(job);
+    detach = job_stopped(job);
+    if (sizing.adaptive && !detach)
+      learn_pipe_sizes(sizing, job);
+  }
+  // Threads of a background or stopped job finish on their own once their
+  // pipes close.
+  for (auto &t : builtin_threads)
+  {
+    if (detach)
+      t.detach();
+    else
+      t.join();
+  }
+  for (auto &plan : plans)
+  {
+    if (detach)
+    {
+      for (auto &t : plan.pumps)
+      {
+        t.detach();
+      }
+      plan.pumps.clear();
+    }
+    join_pumps(plan);
+  }
+  if (last_on_thread && !background && !detach)
+    status = *thread_status;
+  if (pipeline.timed && !background && !detach)
+  {
+    vector<StageUsage> stages = *thread_usage;
+    for (const auto &p : job.procs)
+    {
+      stages[p.stage].usage = p.usage;
+      stages[p.stage].real = p.finished - started;
+      stages[p.stage].in_shell = false;
+    }
+    for (int i = 0; i < n; i++)
+    {
+      Pipeline single;
+      single.stages.push_back(pipeline.stages[i]);
+      stages[i].command = job_text(single);
+    }
+    report_time(monotonic_seconds() - started, stages);
+  }
+  return status;
+}
+
+// Executable index for Tab completion and PATH lookups: each PATH directory's
+// sorted listing of executables, and for completion a merged, deduplicated
+// array of those and the builtins. The index is published as immutable
+// snapshots, so readers take a reference and never wait on a scan. An
+// interactive shell builds it on a background worker started at startup,
+// which keeps it current with inotify watches on the PATH directories; other
+// shells build it on first use. Lookups only trust a listing while the
+// directory's mtime matches the one it was taken at.
+struct DirListing
+{
+  string name;
+  struct timespec mtime = {};
+  vector<string> entries;
+};
+
+struct IndexSnapshot
+{
+  string path_env;
+  vector<shared_ptr<const DirListing>> dirs;
+  vector<string> names;
+  bool complete = false; // every PATH directory has been listed
+};
+
+// How long Tab waits for the worker before answering from a partial index.
+static const auto COMPLETION_BUDGET = chrono::milliseconds(50);
+
+// State shared with the worker, guarded by its mutex. It is never freed: the
+// detached worker can still be running while static destructors run at exit.
+struct IndexShared
+{
+  mutex lock;
+  condition_variable published;
+  shared_ptr<const IndexSnapshot> current;
+  string requested_path;
+  string requested_file;
+  const vector<string> builtins = ::builtins;
+};
+
+static IndexShared &index_shared = *new IndexShared;
+static int index_wake_fd = -1; // eventfd; -1 without a worker
+static string index_sent_path; // main thread only
+
+static void index_publish(shared_ptr<const IndexSnapshot> snap)
+{
+  {
+    lock_guard<mutex> lock(index_shared.lock);
+    index_shared.current = move(snap);
+  }
+  index_shared.published.notify_all();
+}
+
+// Merges builtins and every directory listing into one sorted array.
+static vector<string> index_merge_names(const vector<shared_ptr<const DirListing>> &dirs)
+{
+  vector<string> names = index_shared.builtins;
+  for (const auto &d : dirs)
+  {
+    names.insert(names.end(), d->entries.begin(), d->entries.end());
+  }
+  sort(names.begin(), names.end());
+  names.erase(unique(names.begin(), names.end()), names.end());
+  return names;
+}
+
+static bool index_is_executable(int dirfd, const char *name)
+{
+  struct stat st;
+  if (fstatat(dirfd, name, &st, 0) != 0)
+    return false;
+  return S_ISREG(st.st_mode) && (st.st_mode & S_IXUSR);
+}
+
+static void index_scan_dir(DirListing &d)
+{
+  DIR *dir = opendir(d.name.empty() ? "." : d.name.c_str());
+  if (!dir)
+    return;
+  int fd = dirfd(dir);
+  while (struct dirent *entry = readdir(dir))
+  {
+    if (entry->d_type == DT_DIR)
+      continue;
+    if (index_is_executable(fd, entry->d_name))
+      d.entries.emplace_back(entry->d_name);
+  }
+  closedir(dir);
+  sort(d.entries.begin(), d.entries.end());
+}
+
+// On-disk snapshot of the index, so short-lived shells skip the scan. It
+// records each absolute PATH directory's mtime and executables; a new shell
+// maps it, takes the listings of directories whose mtime still matches and
+// rescans only the rest, rewriting the snapshot if it had to. Stored at
+// SHELL_PATH_INDEX (default ~/.cache/shell/path-index; empty disables).
+// Layout: header, directory records, name offsets, NUL-terminated strings.
+struct SnapshotHeader
+{
+  char magic[8];
+  uint32_t dirs;
+  uint32_t names;
+  uint32_t strings_len;
+  uint32_t reserved;
+};
+
+struct SnapshotDir
+{
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint32_t path;  // offset into the strings
+  uint32_t first; // first entry in the name offsets
+  uint32_t count;
+  uint32_t reserved;
+};
+
+static const char SNAPSHOT_MAGIC[8] = {'s', 'h', 'p', 'i', 'd', 'x', '1', '\0'};
+static const size_t SNAPSHOT_MAX_DIRS = 64;
+
+struct Snapshot
+{
+  const char *map = nullptr;
+  size_t len = 0;
+  const SnapshotHeader *header = nullptr;
+  const SnapshotDir *dirs = nullptr;
+  const uint32_t *names = nullptr;
+  const char *strings = nullptr;
+};
+
+static string shell_cache_root()
+{
+  const char *xdg = variable_value("XDG_CACHE_HOME");
+  if (xdg && *xdg)
+    return string(xdg) + "/shell";
+  const char *home = variable_value("HOME");
+  return string(home ? home : "/tmp") + "/.cache/shell";
+}
+
+static string snapshot_file()
+{
+  const char *file = variable_value("SHELL_PATH_INDEX");
+  if (file)
+    return file;
+  return shell_cache_root() + "/path-index";
+}
+
+static void snapshot_close(Snapshot &snap)
+{
+  if (snap.map)
+    munmap((void *)snap.map, snap.len);
+  snap = Snapshot();
+}
+
+static bool snapshot_open(Snapshot &snap, const string &file)
+{
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SnapshotHeader))
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  snap.map = (const char *)map;
+  snap.len = st.st_size;
+  snap.header = (const SnapshotHeader *)snap.map;
+  const SnapshotHeader &h = *snap.header;
+  size_t dirs_end = sizeof(SnapshotHeader) + (size_t)h.dirs * sizeof(SnapshotDir);
+  size_t names_end = dirs_end + (size_t)h.names * sizeof(uint32_t);
+  if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || names_end + h.strings_len != snap.len ||
+      h.strings_len == 0)
+  {
+    snapshot_close(snap);
+    return false;
+  }
+  snap.dirs = (const SnapshotDir *)(snap.map + sizeof(SnapshotHeader));
+  snap.names = (const uint32_t *)(snap.map + dirs_end);
+  snap.strings = snap.map + names_end;
+  bool valid = snap.strings[h.strings_len - 1] == '\0';
+  for (uint32_t i = 0; valid && i < h.dirs; i++)
+  {
+    valid = snap.dirs[i].path < h.strings_len && (uint64_t)snap.dirs[i].first + snap.dirs[i].count <= h.names;
+  }
+  for (uint32_t i = 0; valid && i < h.names; i++)
+  {
+    valid = snap.names[i] < h.strings_len;
+  }
+  if (!valid)
+    snapshot_close(snap);
+  return valid;
+}
+
+static const SnapshotDir *snapshot_find(const Snapshot &snap, const string &dir)
+{
+  for (uint32_t i = 0; snap.map && i < snap.header->dirs; i++)
+  {
+    if (dir == snap.strings + snap.dirs[i].path)
+      return &snap.dirs[i];
+  }
+  return nullptr;
+}
+
+// The snapshot as non-interactive lookups see it: mapped read-only on first
+// use (and again if SHELL_PATH_INDEX changes), never scanned or rewritten.
+static Snapshot peek_snapshot;
+static string peek_snapshot_file;
+static bool peek_snapshot_tried = false;
+
+static const Snapshot *snapshot_peek()
+{
+  string file = snapshot_file();
+  if (!peek_snapshot_tried || file != peek_snapshot_file)
+  {
+    snapshot_close(peek_snapshot);
+    peek_snapshot_tried = true;
+    peek_snapshot_file = file;
+    if (!file.empty())
+      snapshot_open(peek_snapshot, file);
+  }
+  return peek_snapshot.map ? &peek_snapshot : nullptr;
+}
+
+// Whether the snapshot lists cmd in dir, or nullopt if it cannot say (no
+// record for dir, or one taken at another mtime).
+static optional<bool> snapshot_lookup(const Snapshot *snap, const string &dir, const string &cmd,
+                                      const struct timespec &mtime)
+{
+  if (!snap || dir.empty() || dir[0] != '/' || cmd.find('/') != string::npos)
+    return nullopt;
+  const SnapshotDir *rec = snapshot_find(*snap, dir);
+  if (!rec || rec->mtime_sec != mtime.tv_sec || rec->mtime_nsec != mtime.tv_nsec)
+    return nullopt;
+  const uint32_t *first = snap->names + rec->first;
+  const uint32_t *last = first + rec->count;
+  const uint32_t *it = lower_bound(first, last, cmd, [snap](uint32_t name, const string &key)
+                                   { return strcmp(snap->strings + name, key.c_str()) < 0; });
+  return it != last && cmd == snap->strings + *it;
+}
+
+// Writes the current listings, plus the old snapshot's records for
+// directories outside this PATH (so shells with different PATHs share one
+// file), and renames it into place.
+static void snapshot_save(const string &file, const vector<shared_ptr<const DirListing>> &listings, const Snapshot &old)
+{
+  struct Record
+  {
+    string path;
+    struct timespec mtime;
+    vector<string_view> names;
+  };
+  vector<Record> records;
+  for (const auto &d : listings)
+  {
+    if (d->name.empty() || d->name[0] != '/' || d->mtime.tv_sec == 0)
+      continue;
+    records.push_back({d->name, d->mtime, vector<string_view>(d->entries.begin(), d->entries.end())});
+  }
+  for (uint32_t i = 0; old.map && i < old.header->dirs && records.size() < SNAPSHOT_MAX_DIRS; i++)
+  {
+    const SnapshotDir &rec = old.dirs[i];
+    string path = old.strings + rec.path;
+    if (any_of(records.begin(), records.end(), [&](const Record &r)
+               { return r.path == path; }))
+      continue;
+    Record r{path, {(time_t)rec.mtime_sec, (long)rec.mtime_nsec}, {}};
+    for (uint32_t k = 0; k < rec.count; k++)
+    {
+      r.names.emplace_back(old.strings + old.names[rec.first + k]);
+    }
+    records.push_back(move(r));
+  }
+
+  SnapshotHeader header = {};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  vector<SnapshotDir> dirs;
+  vector<uint32_t> names;
+  string strings;
+  for (const auto &r : records)
+  {
+    SnapshotDir rec = {};
+    rec.mtime_sec = r.mtime.tv_sec;
+    rec.mtime_nsec = r.mtime.tv_nsec;
+    rec.path = strings.size();
+    strings.append(r.path).push_back('\0');
+    rec.first = names.size();
+    rec.count = r.names.size();
+    for (string_view name : r.names)
+    {
+      names.push_back(strings.size());
+      strings.append(name).push_back('\0');
+    }
+    dirs.push_back(rec);
+  }
+  if (strings.empty())
+    return;
+  header.dirs = dirs.size();
+  header.names = names.size();
+  header.strings_len = strings.size();
+
+  error_code ec;
+  filesystem::create_directories(filesystem::path(file).parent_path(), ec);
+  string tmp = file + ".tmp" + to_string(getpid());
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+  bool ok = write_all(fd, (const char *)&header, sizeof(header)) &&
+            write_all(fd, (const char *)dirs.data(), dirs.size() * sizeof(SnapshotDir)) &&
+            write_all(fd, (const char *)names.data(), names.size() * sizeof(uint32_t)) &&
+            write_all(fd, strings.data(), strings.size());
+  if (close(fd) != 0 || !ok || rename(tmp.c_str(), file.c_str()) != 0)
+    unlink(tmp.c_str());
+}
+
+static const uint32_t INDEX_WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                                         IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+// Lists every directory of path_env, taking unchanged ones from the on-disk
+// snapshot. With a worker, each directory that needed a scan publishes a
+// partial index, so Tab can answer while a slow directory is still being
+// read, and wds receives the directory watches.
+static shared_ptr<const IndexSnapshot> index_build(const string &path_env, const string &file, int inotify_fd,
+                                                   vector<int> &wds)
+{
+  TraceScope trace("index");
+  auto next = make_shared<IndexSnapshot>();
+  next->path_env = path_env;
+  wds.clear();
+  Snapshot snap;
+  if (!file.empty())
+    snapshot_open(snap, file);
+  bool changed = false;
+  for (const auto &dir : split_path(path_env))
+  {
+    auto d = make_shared<DirListing>();
+    d->name = dir;
+    const char *at = dir.empty() ? "." : dir.c_str();
+    wds.push_back(inotify_fd != -1 ? inotify_add_watch(inotify_fd, at, INDEX_WATCH_MASK) : -1);
+    // The mtime is read after the watch is in place, so no change is missed.
+    struct stat st;
+    bool scanned = false;
+    if (stat(at, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+      d->mtime = st.st_mtim;
+      const SnapshotDir *rec = dir[0] == '/' ? snapshot_find(snap, dir) : nullptr;
+      if (rec && rec->mtime_sec == st.st_mtim.tv_sec && rec->mtime_nsec == st.st_mtim.tv_nsec)
+      {
+        d->entries.reserve(rec->count);
+        for (uint32_t k = 0; k < rec->count; k++)
+        {
+          d->entries.emplace_back(snap.strings + snap.names[rec->first + k]);
+        }
+      }
+      else
+      {
+        index_scan_dir(*d);
+        scanned = true;
+        changed = changed || dir[0] == '/';
+      }
+    }
+    next->dirs.push_back(move(d));
+    if (scanned && index_wake_fd != -1)
+    {
+      auto partial = make_shared<IndexSnapshot>(*next);
+      partial->names = index_merge_names(partial->dirs);
+      index_publish(move(partial));
+    }
+  }
+  next->names = index_merge_names(next->dirs);
+  next->complete = true;
+  if (changed && !file.empty())
+    snapshot_save(file, next->dirs, snap);
+  snapshot_close(snap);
+  return next;
+}
+
+// Applies one batch of inotify events to snap, copying only the listings
+// they touch. Returns nullptr when the index must be rebuilt instead.
+static shared_ptr<const IndexSnapshot> index_apply_events(const shared_ptr<const IndexSnapshot> &snap,
+                                                          const vector<int> &wds, const char *buf, ssize_t len)
+{
+  auto next = make_shared<IndexSnapshot>(*snap);
+  map<size_t, shared_ptr<DirListing>> touched;
+  for (const char *p = buf; p < buf + len;)
+  {
+    auto *ev = reinterpret_cast<const struct inotify_event *>(p);
+    p += sizeof(struct inotify_event) + ev->len;
+    if (ev->mask & IN_Q_OVERFLOW)
+      return nullptr;
+    for (size_t k = 0; k < wds.size(); k++)
+    {
+      if (wds[k] != ev->wd || ev->wd == -1)
+        continue;
+      auto &d = touched[k];
+      if (!d)
+        d = make_shared<DirListing>(*next->dirs[k]);
+      if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+      {
+        d->entries.clear();
+        d->mtime = {};
+        continue;
+      }
+      if (ev->len == 0 || (ev->mask & IN_ISDIR))
+        continue;
+      string name = ev->name;
+      auto it = lower_bound(d->entries.begin(), d->entries.end(), name);
+      bool present = it != d->entries.end() && *it == name;
+      bool executable = false;
+      if (!(ev->mask & (IN_DELETE | IN_MOVED_FROM)))
+      {
+        string full = (filesystem::path(d->name) / name).string();
+        executable = index_is_executable(AT_FDCWD, full.c_str());
+      }
+      if (executable && !present)
+        d->entries.insert(it, name);
+      else if (!executable && present)
+        d->entries.erase(it);
+      // The listing is current again, as of the directory's new mtime.
+      struct stat st;
+      if (stat(d->name.c_str(), &st) == 0)
+        d->mtime = st.st_mtim;
+    }
+  }
+  if (touched.empty())
+    return snap;
+  for (auto &t : touched)
+  {
+    next->dirs[t.first] = move(t.second);
+  }
+  next->names = index_merge_names(next->dirs);
+  return next;
+}
+
+// Background worker of interactive shells: (re)builds the index for the
+// requested PATH, then sleeps until a directory changes or the main thread
+// hands over a new PATH through index_wake_fd.
+static void index_worker()
+{
+  shared_ptr<const IndexSnapshot> snap;
+  int inotify_fd = -1;
+  vector<int> wds;
+  alignas(struct inotify_event) char buf[16384];
+  while (true)
+  {
+    string path, file;
+    {
+      lock_guard<mutex> lock(index_shared.lock);
+      path = index_shared.requested_path;
+      file = index_shared.requested_file;
+    }
+    if (!snap || snap->path_env != path)
+    {
+      if (inotify_fd != -1)
+        close(inotify_fd);
+      inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      snap = index_build(path, file, inotify_fd, wds);
+      index_publish(snap);
+    }
+    struct pollfd fds[2] = {{index_wake_fd, POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+    if (poll(fds, inotify_fd != -1 ? 2 : 1, -1) < 0)
+      continue;
+    if (fds[0].revents & POLLIN)
+    {
+      uint64_t count;
+      if (read(index_wake_fd, &count, sizeof(count)) < 0)
+        continue;
+    }
+    if (inotify_fd == -1 || !(fds[1].revents & POLLIN))
+      continue;
+    ssize_t len;
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0 && snap)
+    {
+      snap = index_apply_events(snap, wds, buf, len);
+    }
+    if (snap)
+      index_publish(snap);
+  }
+}
+
+// Starts the worker with signals blocked, so they keep going to the main
+// thread.
+static void index_start_worker()
+{
+  index_wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (index_wake_fd < 0)
+    return;
+  const char *env_p = value_of(path_variable());
+  index_sent_path = env_p ? env_p : "";
+  index_shared.requested_path = index_sent_path;
+  index_shared.requested_file = snapshot_file();
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  thread(index_worker).detach();
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+// The latest index. Hands a changed PATH to the worker without waiting for
+// it; without a worker, (re)builds the index in place.
+static shared_ptr<const IndexSnapshot> index_get()
+{
+  const char *env_p = value_of(path_variable());
+  string path = env_p ? env_p : "";
+  if (index_wake_fd != -1)
+  {
+    if (path != index_sent_path)
+    {
+      {
+        lock_guard<mutex> lock(index_shared.lock);
+        index_shared.requested_path = path;
+        index_shared.requested_file = snapshot_file();
+      }
+      index_sent_path = path;
+      uint64_t one = 1;
+      if (write(index_wake_fd, &one, sizeof(one)) < 0)
+        perror("index");
+    }
+    lock_guard<mutex> lock(index_shared.lock);
+    return index_shared.current;
+  }
+  lock_guard<mutex> lock(index_shared.lock);
+  if (!index_shared.current || index_shared.current->path_env != path)
+  {
+    vector<int> wds;
+    index_shared.current = index_build(path, snapshot_file(), -1, wds);
+  }
+  return index_shared.current;
+}
+
+// The index if one is at hand: the worker's latest, or one already built for
+// the current PATH. Unlike index_get, never builds it in place.
+static shared_ptr<const IndexSnapshot> index_peek()
+{
+  if (index_wake_fd != -1)
+    return index_get();
+  const char *env_p = value_of(path_variable());
+  lock_guard<mutex> lock(index_shared.lock);
+  if (index_shared.current && index_shared.current->path_env == (env_p ? env_p : ""))
+    return index_shared.current;
+  return nullptr;
+}
+
+// Whether PATH directory dir_index (dir) lists cmd as an executable, or
+// nullopt if the index cannot say (not yet built for this PATH, relative
+// directory, or its mtime is no longer the listing's).
+static optional<bool> index_lookup(const IndexSnapshot *index, size_t dir_index, const string &dir,
+                                   const string &cmd, const struct timespec &mtime)
+{
+  if (!index || dir_index >= index->dirs.size() || cmd.find('/') != string::npos)
+    return nullopt;
+  const DirListing &d = *index->dirs[dir_index];
+  if (d.name != dir || d.name.empty() || d.name[0] != '/' || d.mtime.tv_sec != mtime.tv_sec || d.mtime.tv_nsec != mtime.tv_nsec)
+    return nullopt;
+  return binary_search(d.entries.begin(), d.entries.end(), cmd);
+}
+
+// Answers from the latest index. While the worker is still building the one
+// for the current PATH, waits for it at most COMPLETION_BUDGET and then
+// answers from whatever has been listed so far.
+vector<string> completion_matches(const string &prefix)
+{
+  auto index = index_get();
+  if (index_wake_fd != -1 && (!index || !index->complete || index->path_env != index_sent_path))
+  {
+    auto ready = [&]
+    {
+      const auto &cur = index_shared.current;
+      return cur && cur->complete && cur->path_env == index_sent_path;
+    };
+    unique_lock<mutex> lock(index_shared.lock);
+    index_shared.published.wait_for(lock, COMPLETION_BUDGET, ready);
+    index = index_shared.current;
+  }
+  vector<string> matches;
+  if (!index)
+  {
+    for (const auto &b : builtins)
+    {
+      if (b.compare(0, prefix.size(), prefix) == 0)
+        matches.push_back(b);
+    }
+    sort(matches.begin(), matches.end());
+    return matches;
+  }
+  for (auto it = lower_bound(index->names.begin(), index->names.end(), prefix);
+       it != index->names.end() && it->compare(0, prefix.size(), prefix) == 0; ++it)
+  {
+    matches.push_back(*it);
+  }
+  return matches;
+}
+
+// Filename completion for arguments. Each directory's listing is cached with
+// its mtime; it is read with getdents64 and classified by d_type, so only
+// symlinks and filesystems that leave d_type unset cost a stat, and after the
+// first scan a Tab in a large directory is a range lookup.
+struct ListingEntry
+{
+  uint32_t name; // offset into the listing's arena
+  uint32_t len;
+  bool is_dir;
+};
+
+struct CachedListing
+{
+  struct timespec mtime = {};
+  bool settled = false; // taken at least a second after the last change
+  string arena;         // the names, NUL-terminated
+  vector<ListingEntry> entries; // sorted by name
+  uint64_t used = 0;
+
+  string_view name(const ListingEntry &e) const { return string_view(arena.data() + e.name, e.len); }
+};
+
+// Calls visit(name, length, d_type) for each entry of the open directory fd
+// except "." and "..", reading it with getdents64 in large batches.
+template <class Visit>
+static void scan_dirents(int fd, Visit &&visit)
+{
+  alignas(struct dirent64) char buf[65536];
+  ssize_t len;
+  while ((len = getdents64(fd, buf, sizeof(buf))) > 0)
+  {
+    for (char *p = buf; p < buf + len;)
+    {
+      auto *entry = reinterpret_cast<struct dirent64 *>(p);
+      p += entry->d_reclen;
+      const char *name = entry->d_name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+      visit(name, strlen(name), entry->d_type);
+    }
+  }
+}
+
+// Whether an entry of directory fd is a directory, from its d_type when that
+// settles it; symlinks are only followed with follow_links.
+static bool dirent_is_dir(int fd, const char *name, unsigned char type, bool follow_links)
+{
+  if (type == DT_DIR)
+    return true;
+  if (type != DT_UNKNOWN && (type != DT_LNK || !follow_links))
+    return false;
+  struct stat st;
+  return fstatat(fd, name, &st, follow_links ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+static unordered_map<string, CachedListing> listing_cache;
+static uint64_t listing_clock = 0;
+static const size_t LISTING_CACHE_DIRS = 32;
+// A second Tab with more matches than this reports their number instead.
+static const size_t COMPLETION_LIST_MAX = 1000;
+
+static const CachedListing *listing_get(const string &dir)
+{
+  int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return nullptr;
+  }
+  auto it = listing_cache.find(dir);
+  if (it != listing_cache.end() && it->second.settled && it->second.mtime.tv_sec == st.st_mtim.tv_sec &&
+      it->second.mtime.tv_nsec == st.st_mtim.tv_nsec)
+  {
+    close(fd);
+    it->second.used = ++listing_clock;
+    return &it->second;
+  }
+
+  TraceScope trace("listing", dir);
+  if (it == listing_cache.end())
+  {
+    if (listing_cache.size() >= LISTING_CACHE_DIRS)
+    {
+      listing_cache.erase(min_element(listing_cache.begin(), listing_cache.end(), [](const auto &a, const auto &b)
+                                      { return a.second.used < b.second.used; }));
+    }
+    it = listing_cache.emplace(dir, CachedListing()).first;
+  }
+  CachedListing &listing = it->second;
+  listing.arena.clear();
+  listing.entries.clear();
+  scan_dirents(fd, [&](const char *name, size_t name_len, unsigned char type)
+               {
+    listing.entries.push_back({(uint32_t)listing.arena.size(), (uint32_t)name_len, dirent_is_dir(fd, name, type, true)});
+    listing.arena.append(name, name_len + 1); });
+  close(fd);
+  sort(listing.entries.begin(), listing.entries.end(), [&](const ListingEntry &a, const ListingEntry &b)
+       { return listing.name(a) < listing.name(b); });
+
+  // A change within the same mtime tick as the scan would go unnoticed, so a
+  // listing of a directory that just changed is rescanned next time.
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  listing.mtime = st.st_mtim;
+  listing.settled = now.tv_sec > st.st_mtim.tv_sec;
+  listing.used = ++listing_clock;
+  return &listing;
+}
+
+// Completed words are backslash-escaped wherever the lexer would otherwise
+// split or interpret them.
+static void completion_escape(string_view name, string &out)
+{
+  static const char special[] = " \t\\'\"|;&<>";
+  if (name.find_first_of(special) == string_view::npos)
+  {
+    out += name;
+    return;
+  }
+  for (char ch : name)
+  {
+    if (strchr(special, ch))
+      out.push_back('\\');
+    out.push_back(ch);
+  }
+}
+
+static string completion_unescape(string_view word)
+{
+  string out;
+  for (size_t i = 0; i < word.size(); i++)
+  {
+    if (word[i] == '\\' && i + 1 < word.size())
+      i++;
+    out.push_back(word[i]);
+  }
+  return out;
+}
+
+static char completion_word_breaks[] = " \t\n|;&<>";
+
+// Readline hook: a break character preceded by a backslash is part of the word.
+static int completion_char_is_quoted(char *line, int index)
+{
+  int backslashes = 0;
+  while (index - backslashes > 0 && line[index - backslashes - 1] == '\\')
+  {
+    backslashes++;
+  }
+  return backslashes % 2;
+}
+
+// Files and directories whose path starts with word (as typed: escaped, or
+// the inside of a quoted word); directories get a trailing slash. Dotfiles
+// only match a name prefix that starts with a dot.
+vector<string> filename_matches(const string &word, bool dirs_only, bool quoted)
+{
+  auto unescape = [&](string_view text)
+  { return quoted ? string(text) : completion_unescape(text); };
+  size_t slash = word.rfind('/');
+  string dir_part = slash == string::npos ? "" : word.substr(0, slash + 1);
+  string base = unescape(string_view(word).substr(dir_part.size()));
+  vector<string> matches;
+  const CachedListing *listing = listing_get(unescape(dir_part));
+  if (!listing)
+    return matches;
+  auto first = lower_bound(listing->entries.begin(), listing->entries.end(), base,
+                           [&](const ListingEntry &e, const string &key)
+                           { return listing->name(e) < key; });
+  for (auto it = first; it != listing->entries.end(); ++it)
+  {
+    string_view name = listing->name(*it);
+    if (name.compare(0, base.size(), base) != 0)
+      break;
+    if ((name[0] == '.' && base.empty()) || (dirs_only && !it->is_dir))
+      continue;
+    string match = dir_part;
+    if (quoted)
+      match += name;
+    else
+      completion_escape(name, match);
+    if (it->is_dir)
+      match.push_back('/');
+    matches.push_back(move(match));
+  }
+  return matches;
+}
+
+string find_lcp(const vector<string> &matches)
+{
+  if (matches.empty())
+    return "";
+  const string &first = matches.front();
+  const string &last = matches.back();
+  size_t length = min(first.size(), last.size());
+  size_t i = 0;
+  while (i < length && first[i] == last[i])
+  {
+    i++;
+  }
+  return first.substr(0, i);
+}
+
+// Where the word being completed starts a command: the words before it in
+// the same pipeline stage or list element, which are empty for a command name.
+static string completion_command_words(int start)
+{
+  int from = start;
+  while (from > 0 && !strchr("|;&", rl_line_buffer[from - 1]))
+  {
+    from--;
+  }
+  return string(rl_line_buffer + from, start - from);
+}
+
+char **completion(const char *text, int start, int end)
+{
+  TraceScope trace("completion", text);
+  rl_attempted_completion_over = 1;
+  string current_input(text);
+  string before = completion_command_words(start);
+  bool command_word = before.find_first_not_of(" \t") == string::npos;
+  vector<string> matches;
+  if (command_word && current_input.find('/') == string::npos)
+  {
+    matches = completion_matches(current_input);
+  }
+  else
+  {
+    istringstream words(before);
+    string first;
+    words >> first;
+    matches = filename_matches(current_input, first == "cd", rl_completion_quote_character != 0);
+  }
+  if (matches.empty())
+  {
+    tab_pressed_once = false;
+    return nullptr;
+  }
+  if (matches.size() == 1)
+  {
+    tab_pressed_once = false;
+    rl_completion_suppress_append = matches[0].back() == '/';
+    char **arr = (char **)malloc(2 * sizeof(char *));
+    arr[0] = strdup(matches[0].c_str());
+    arr[1] = nullptr;
+    return arr;
+  }
+  string lcp = find_lcp(matches);
+  if (lcp.length() > current_input.length())
+  {
+    rl_begin_undo_group();
+    rl_delete_text(start, end);
+    rl_point = start;
+    rl_insert_text(lcp.c_str());
+    rl_end_undo_group();
+    rl_redisplay();
+    tab_pressed_once = false;
+    return nullptr;
+  }
+  if (!tab_pressed_once || last_completion_prefix != current_input)
+  {
+    cout << "\x07" << flush;
+    tab_pressed_once = true;
+    last_completion_prefix = current_input;
+    last_matches = move(matches);
+    return nullptr;
+  }
+  // One write for the whole listing, which shows file names without the
+  // directory part.
+  size_t shown_from = current_input.rfind('/') + 1;
+  string listing = "\n";
+  if (last_matches.size() > COMPLETION_LIST_MAX)
+  {
+    listing += to_string(last_matches.size()) + " possibilities";
+  }
+  for (size_t i = 0; i < last_matches.size() && last_matches.size() <= COMPLETION_LIST_MAX; ++i)
+  {
+    string_view shown = string_view(last_matches[i]).substr(shown_from);
+    listing += rl_completion_quote_character ? string(shown) : completion_unescape(shown);
+    if (i + 1 < last_matches.size())
+    {
+      listing += "  ";
+    }
+  }
+  listing += "\n";
+  write_all(STDOUT_FILENO, listing.data(), listing.size());
+  rl_on_new_line();
+  rl_redisplay();
+  tab_pressed_once = false;
+  return nullptr;
+}
+
+int execute_external(const string &path, const vector<string_view> &argv, const vector<Redirection> &redirs)
+{
+  OutputPlan plan = plan_outputs(redirs, -1);
+  if (plan.failed)
+  {
+    close_fds(plan.owned);
+    join_pumps(plan);
+    return 1;
+  }
+  pid_t pid = spawn_command(path, argv, plan.fds, job_control ? 0 : -1);
+  close_fds(plan.owned);
+  int status = 126;
+  Job job;
+  if (pid > 0)
+  {
+    job.pgid = pid;
+    job.procs.push_back({pid});
+    job.last_is_process = true;
+    for (size_t i = 0; i < argv.size(); i++)
+    {
+      job.text += (i ? " " : "") + string(argv[i]);
+    }
+    status = wait_foreground(job);
+  }
+  if (job_stopped(job))
+  {
+    for (auto &t : plan.pumps)
+    {
+      t.detach();
+    }
+    plan.pumps.clear();
+  }
+  join_pumps(plan);
+  return status;
+}
+
+// Output cache for deterministic commands:
+//   cache [-i FILE]... [-e NAME]... [--] COMMAND [ARG...]
+// An entry is keyed on the resolved path and mtime of COMMAND, the working
+// directory, the argv, the values of the -e variables and the mtime and size
+// of each -i file. A hit replays the stored stdout and exit status without
+// running anything. Entries live in SHELL_CACHE_DIR (default
+// ~/.cache/shell/output), one file each; the store is
+// kept under SHELL_CACHE_SIZE MiB (default 100) by evicting the least
+// recently used, tracked through each entry's mtime.
+static const char CACHE_MAGIC[] = "shcache1";
+
+static string cache_dir()
+{
+  const char *dir = variable_value("SHELL_CACHE_DIR");
+  if (dir && *dir)
+    return dir;
+  return shell_cache_root() + "/output";
+}
+
+static size_t cache_limit()
+{
+  const char *size = variable_value("SHELL_CACHE_SIZE");
+  long mib = 100;
+  if (size && *size)
+  {
+    try
+    {
+      mib = stol(size);
+    }
+    catch (...)
+    {
+    }
+  }
+  return (size_t)max(1L, mib) << 20;
+}
+
+static uint64_t fnv1a(string_view data)
+{
+  uint64_t h = 1469598103934665603ULL;
+  for (unsigned char ch : data)
+  {
+    h = (h ^ ch) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static void append_file_stamp(string &key, const string &file)
+{
+  struct stat st;
+  if (stat(file.c_str(), &st) != 0)
+  {
+    key += "missing";
+    return;
+  }
+  key += to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec) + " " + to_string(st.st_size);
+}
+
+// Replays an entry if it exists and was stored under exactly this key.
+static optional<int> cache_replay(const string &entry, const string &key, int out_fd)
+{
+  int fd = open(entry.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullopt;
+  struct stat st;
+  optional<int> status;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map != MAP_FAILED)
+  {
+    string_view data((const char *)map, st.st_size);
+    // Header: magic, status and key length on one line, then the key.
+    size_t nl = data.find('\n');
+    int code = 0;
+    size_t key_len = 0;
+    if (nl != string_view::npos &&
+        sscanf(string(data.substr(0, nl)).c_str(), "shcache1 %d %zu", &code, &key_len) == 2 &&
+        data.size() - nl - 1 >= key_len && data.substr(nl + 1, key_len) == key)
+    {
+      string_view output = data.substr(nl + 1 + key_len);
+      write_all(out_fd, output.data(), output.size());
+      status = code;
+      futimens(fd, nullptr);
+    }
+    munmap(map, st.st_size);
+  }
+  close(fd);
+  return status;
+}
+
+// Drops least recently used entries until the store fits its limit.
+static void cache_evict(const string &dir, size_t limit)
+{
+  vector<tuple<struct timespec, size_t, string>> entries;
+  size_t total = 0;
+  error_code ec;
+  for (const auto &e : filesystem::directory_iterator(dir, ec))
+  {
+    struct stat st;
+    if (stat(e.path().c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    entries.emplace_back(st.st_mtim, st.st_size, e.path().string());
+    total += st.st_size;
+  }
+  if (total <= limit)
+    return;
+  sort(entries.begin(), entries.end(), [](const auto &a, const auto &b)
+       {
+    const auto &x = get<0>(a);
+    const auto &y = get<0>(b);
+    return x.tv_sec != y.tv_sec ? x.tv_sec < y.tv_sec : x.tv_nsec < y.tv_nsec; });
+  for (const auto &e : entries)
+  {
+    if (total <= limit)
+      break;
+    if (unlink(get<2>(e).c_str()) == 0)
+      total -= get<1>(e);
+  }
+}
+
+static void cache_store(const string &dir, const string &entry, const string &key, int status, const string &output)
+{
+  error_code ec;
+  filesystem::create_directories(dir, ec);
+  string tmp = entry + ".tmp" + to_string(getpid());
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return;
+  string header = string(CACHE_MAGIC) + " " + to_string(status) + " " + to_string(key.size()) + "\n" + key;
+  bool ok = write_all(fd, header.data(), header.size()) && write_all(fd, output.data(), output.size());
+  if (close(fd) != 0 || !ok || rename(tmp.c_str(), entry.c_str()) != 0)
+  {
+    unlink(tmp.c_str());
+    return;
+  }
+  cache_evict(dir, cache_limit());
+}
+
+int run_cached(const SimpleCommand &command)
+{
+  const auto &words = command.words;
+  vector<string> inputs;
+  vector<string> vars;
+  size_t i = 1;
+  for (; i < words.size(); i++)
+  {
+    if (words[i] == "--")
+    {
+      i++;
+      break;
+    }
+    if ((words[i] == "-i" || words[i] == "-e") && i + 1 < words.size())
+    {
+      (words[i] == "-i" ? inputs : vars).emplace_back(words[i + 1]);
+      i++;
+      continue;
+    }
+    break;
+  }
+  if (i >= words.size())
+  {
+    cerr << "cache: usage: cache [-i FILE]... [-e NAME]... [--] COMMAND [ARG...]\n";
+    return 2;
+  }
+  vector<string_view> argv(words.begin() + i, words.end());
+  string cmd(argv[0]);
+  auto path = find_in_path(cmd);
+  if (!path)
+  {
+    cout << cmd << ": command not found\n";
+    return 127;
+  }
+
+  TraceScope trace("cache", cmd);
+  string key = *path + "\n";
+  append_file_stamp(key, *path);
+  key += "\n" + filesystem::current_path().string() + "\n";
+  for (auto arg : argv)
+  {
+    key.append(arg.data(), arg.size() + 1);
+  }
+  for (const string &var : vars)
+  {
+    const char *value = variable_value(var);
+    key += "\n" + var + (value ? "=" + string(value) : " unset");
+  }
+  for (const string &file : inputs)
+  {
+    key += "\n" + file + " ";
+    append_file_stamp(key, file);
+  }
+  // What stdin is redirected from is an input too.
+  for (const auto &r : command.redirs)
+  {
+    if (r.fd != STDIN_FILENO)
+      continue;
+    if (r.dup)
+    {
+      key += "\n<&" + string(r.file);
+      continue;
+    }
+    if (r.here == HereKind::None)
+    {
+      key += "\n< " + string(r.file) + " ";
+      append_file_stamp(key, string(r.file));
+      continue;
+    }
+    string storage;
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)fnv1a(here_text(r, storage)));
+    key += string("\n<< ") + hash;
+  }
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long)fnv1a(key));
+  string dir = cache_dir();
+  string entry = dir + "/" + name;
+
+  OutputPlan plan = plan_outputs(command.redirs, -1);
+  if (plan.failed)
+  {
+    close_fds(plan.owned);
+    join_pumps(plan);
+    return 1;
+  }
+  int out_fd = plan_target(plan, STDOUT_FILENO);
+  if (out_fd == -1)
+    out_fd = STDOUT_FILENO;
+  if (auto status = cache_replay(entry, key, out_fd))
+  {
+    close_fds(plan.owned);
+    join_pumps(plan);
+    return *status;
+  }
+
+  // Miss: run the command with stdout on a pipe; a pump thread passes the
+  // output through to its real target and keeps a copy for the entry.
+  int capture[2];
+  if (pipe2(capture, O_CLOEXEC) != 0)
+  {
+    perror("pipe");
+    close_fds(plan.owned);
+    join_pumps(plan);
+    return 1;
+  }
+  vector<pair<int, int>> fds;
+  for (const auto &fd : plan.fds)
+  {
+    if (fd.second != STDOUT_FILENO)
+      fds.push_back(fd);
+  }
+  fds.emplace_back(capture[1], STDOUT_FILENO);
+  size_t limit = cache_limit();
+  auto output = make_shared<string>();
+  auto fits = make_shared<bool>(true);
+  // The pump writes through its own descriptor, so it can outlive the plan
+  // if the job is stopped.
+  int pump_fd = fcntl(out_fd, F_DUPFD_CLOEXEC, 0);
+  thread pump([in = capture[0], out_fd = pump_fd, output, fits, limit]()
+              {
+    vector<char> buf(1 << 16);
+    ssize_t got;
+    while ((got = read(in, buf.data(), buf.size())) > 0 || (got < 0 && errno == EINTR))
+    {
+      if (got <= 0)
+        continue;
+      write_all(out_fd, buf.data(), got);
+      if (*fits && output->size() + got <= limit)
+        output->append(buf.data(), got);
+      else
+      {
+        *fits = false;
+        output->clear();
+      }
+    }
+    close(in);
+    close(out_fd); });
+
+  pid_t pid = spawn_command(*path, argv, fds, job_control ? 0 : -1);
+  close(capture[1]);
+  int status = 126;
+  Job job;
+  if (pid > 0)
+  {
+    job.pgid = pid;
+    job.procs.push_back({pid});
+    job.last_is_process = true;
+    Pipeline single;
+    single.stages.push_back(command);
+    job.text = job_text(single);
+    status = wait_foreground(job);
+  }
+  if (job_stopped(job))
+  {
+    // Finishes on its own when the job does; the output is not cached.
+    pump.detach();
+    close_fds(plan.owned);
+    for (auto &t : plan.pumps)
+    {
+      t.detach();
+    }
+    plan.pumps.clear();
+    return status;
+  }
+  pump.join();
+  close_fds(plan.owned);
+  join_pumps(plan);
+  if (pid > 0 && *fits)
+    cache_store(dir, entry, key, status, *output);
+  return status;
+}
+
+// Pathname expansion. A pattern is compiled once into per-component matchers;
+// the walk reads directories with getdents64 and uses d_type to tell
+// directories apart without a stat. Components without glob characters are
+// looked up directly instead of scanned. A "**" component matches any number
+// of directories (not following symlinks, skipping hidden ones); patterns
+// containing one are walked by a pool of threads sharing a queue of
+// directories. Matches are sorted bytewise, so the output is deterministic.
+struct GlobOp
+{
+  enum Kind
+  {
+    Literal,
+    Any,
+    Star,
+    Class
+  } kind;
+  string text;           // Literal
+  bitset<256> set;       // Class
+};
+
+struct GlobSegment
+{
+  vector<GlobOp> ops;
+  string literal;        // the unescaped component when it has no glob characters
+  bool is_literal = true;
+  bool globstar = false; // "**"
+  bool dot = false;      // starts with a literal '.', so it may match dotfiles
+};
+
+struct GlobPattern
+{
+  string root; // "/" for absolute patterns
+  vector<GlobSegment> segments;
+  bool dirs_only = false; // trailing slash
+  bool has_globstar = false;
+};
+
+static GlobSegment compile_glob_segment(string_view text)
+{
+  GlobSegment seg;
+  seg.globstar = text == "**";
+  auto literal = [&](char ch)
+  {
+    if (seg.ops.empty() || seg.ops.back().kind != GlobOp::Literal)
+      seg.ops.push_back({GlobOp::Literal, "", {}});
+    seg.ops.back().text.push_back(ch);
+    seg.literal.push_back(ch);
+  };
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    char ch = text[i];
+    if (ch == '\\' && i + 1 < text.size())
+    {
+      literal(text[++i]);
+      continue;
+    }
+    if (ch == '*')
+    {
+      if (seg.ops.empty() || seg.ops.back().kind != GlobOp::Star)
+        seg.ops.push_back({GlobOp::Star, "", {}});
+      seg.is_literal = false;
+      continue;
+    }
+    if (ch == '?')
+    {
+      seg.ops.push_back({GlobOp::Any, "", {}});
+      seg.is_literal = false;
+      continue;
+    }
+    if (ch == '[')
+    {
+      // [abc], [a-z], [!x] or [^x]; a ']' right after the opening is a member.
+      size_t j = i + 1;
+      bool negate = j < text.size() && (text[j] == '!' || text[j] == '^');
+      if (negate)
+        j++;
+      GlobOp op{GlobOp::Class, "", {}};
+      bool closed = false;
+      for (size_t first = j; j < text.size(); j++)
+      {
+        if (text[j] == ']' && j > first)
+        {
+          closed = true;
+          break;
+        }
+        unsigned char lo = text[j];
+        if (lo == '\\' && j + 1 < text.size())
+          lo = text[++j];
+        unsigned char hi = lo;
+        if (j + 2 < text.size() && text[j + 1] == '-' && text[j + 2] != ']')
+        {
+          j += 2;
+          hi = text[j];
+          if (hi == '\\' && j + 1 < text.size())
+            hi = text[++j];
+        }
+        for (unsigned c = lo; c <= hi; c++)
+        {
+          op.set.set(c);
+        }
+      }
+      if (closed)
+      {
+        if (negate)
+          op.set.flip();
+        seg.ops.push_back(move(op));
+        seg.is_literal = false;
+        i = j;
+        continue;
+      }
+    }
+    literal(ch);
+  }
+  seg.dot = !seg.ops.empty() && seg.ops[0].kind == GlobOp::Literal && seg.ops[0].text[0] == '.';
+  return seg;
+}
+
+static GlobPattern compile_glob(string_view pattern)
+{
+  GlobPattern glob;
+  if (!pattern.empty() && pattern[0] == '/')
+    glob.root = "/";
+  size_t at = glob.root.size();
+  while (at < pattern.size())
+  {
+    size_t slash = pattern.find('/', at);
+    string_view text = pattern.substr(at, slash == string_view::npos ? string_view::npos : slash - at);
+    at = slash == string_view::npos ? pattern.size() : slash + 1;
+    if (text.empty())
+      continue;
+    GlobSegment seg = compile_glob_segment(text);
+    // "**/**" walks the same directories as "**".
+    if (seg.globstar && !glob.segments.empty() && glob.segments.back().globstar)
+      continue;
+    glob.has_globstar = glob.has_globstar || seg.globstar;
+    glob.segments.push_back(move(seg));
+  }
+  glob.dirs_only = !pattern.empty() && pattern.back() == '/';
+  return glob;
+}
+
+// Wildcard match with a single backtrack point: after a mismatch, the last
+// '*' absorbs one more character and matching resumes behind it.
+static bool glob_match(const GlobSegment &seg, string_view name)
+{
+  if (name[0] == '.' && !seg.dot)
+    return false;
+  size_t op = 0, at = 0;
+  size_t star_op = string::npos, star_at = 0;
+  while (op < seg.ops.size() || at < name.size())
+  {
+    if (op < seg.ops.size())
+    {
+      const GlobOp &o = seg.ops[op];
+      if (o.kind == GlobOp::Star)
+      {
+        star_op = op++;
+        star_at = at;
+        continue;
+      }
+      if (o.kind == GlobOp::Literal ? name.compare(at, o.text.size(), o.text) == 0
+                                    : at < name.size() && (o.kind == GlobOp::Any || o.set.test((unsigned char)name[at])))
+      {
+        op++;
+        at += o.kind == GlobOp::Literal ? o.text.size() : 1;
+        continue;
+      }
+    }
+    if (star_op == string::npos || star_at >= name.size())
+      return false;
+    op = star_op + 1;
+    at = ++star_at;
+  }
+  return true;
+}
+
+// Shared state of one expansion: the queue of directories still to read and
+// each worker's matches, kept as NUL-terminated paths in one arena per worker.
+struct GlobWalk
+{
+  struct Task
+  {
+    string dir; // as it will appear in the matches: "" or ending in '/'
+    size_t segment;
+    bool descended = false; // queued by "**" for one of its own directories
+  };
+
+  const GlobPattern &glob;
+  mutex lock;
+  condition_variable ready;
+  vector<Task> queue;
+  size_t busy = 0;
+
+  GlobWalk(const GlobPattern &glob) : glob(glob) {}
+
+  void push(string dir, size_t segment, bool descended = false)
+  {
+    {
+      lock_guard<mutex> guard(lock);
+      queue.push_back({move(dir), segment, descended});
+    }
+    ready.notify_one();
+  }
+};
+
+struct GlobMatches
+{
+  string arena;
+  vector<pair<uint32_t, uint32_t>> paths; // offset and length in the arena
+};
+
+static void glob_emit(const GlobWalk &walk, GlobMatches &out, const string &dir, string_view name)
+{
+  out.paths.push_back({(uint32_t)out.arena.size(), (uint32_t)(dir.size() + name.size() + walk.glob.dirs_only)});
+  out.arena += dir;
+  out.arena += name;
+  if (walk.glob.dirs_only)
+    out.arena.push_back('/');
+  out.arena.push_back('\0');
+}
+
+// Offers directory entry `name` (NUL-terminated) of `dir` to segment `seg`:
+// emits it if that is the last segment, or queues it for the next one if it
+// is a directory.
+static void glob_offer(GlobWalk &walk, GlobMatches &out, int fd, const string &dir, string_view name,
+                       unsigned char type, size_t seg)
+{
+  const GlobSegment &s = walk.glob.segments[seg];
+  if (s.is_literal ? name != s.literal : !glob_match(s, name))
+    return;
+  bool last = seg + 1 == walk.glob.segments.size();
+  if (last && !walk.glob.dirs_only)
+  {
+    glob_emit(walk, out, dir, name);
+    return;
+  }
+  if (!dirent_is_dir(fd, name.data(), type, true))
+    return;
+  if (last)
+    glob_emit(walk, out, dir, name);
+  else
+    walk.push(dir + string(name) + "/", seg + 1);
+}
+
+// Reads one queued directory.
+static void glob_visit(GlobWalk &walk, GlobMatches &out, const GlobWalk::Task &task)
+{
+  const GlobPattern &glob = walk.glob;
+  const GlobSegment &seg = glob.segments[task.segment];
+  const char *at = task.dir.empty() ? "." : task.dir.c_str();
+  bool last = task.segment + 1 == glob.segments.size();
+  if (seg.is_literal)
+  {
+    // No scan needed: the name either exists or not.
+    struct stat st;
+    string path = task.dir + seg.literal;
+    if (!last)
+      walk.push(path + "/", task.segment + 1);
+    else if (lstat(path.c_str(), &st) == 0 && (!glob.dirs_only || (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))))
+      glob_emit(walk, out, task.dir, seg.literal);
+    return;
+  }
+  int fd = open(at, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  // A trailing "**" also matches no directory at all: "a/**" and "a/**/"
+  // include "a/" itself.
+  if (seg.globstar && last && !task.descended && !task.dir.empty())
+  {
+    if (glob.dirs_only)
+      glob_emit(walk, out, task.dir.substr(0, task.dir.size() - 1), "");
+    else
+      glob_emit(walk, out, task.dir, "");
+  }
+  scan_dirents(fd, [&](const char *name, size_t len, unsigned char type)
+               {
+    string_view entry(name, len);
+    if (!seg.globstar)
+    {
+      glob_offer(walk, out, fd, task.dir, entry, type, task.segment);
+      return;
+    }
+    // "**" matching no further directory: the entry meets the next segment
+    // here; a trailing "**" matches every entry.
+    if (last && name[0] != '.' && (!glob.dirs_only || dirent_is_dir(fd, name, type, true)))
+      glob_emit(walk, out, task.dir, entry);
+    else if (!last)
+      glob_offer(walk, out, fd, task.dir, entry, type, task.segment + 1);
+    if (name[0] != '.' && dirent_is_dir(fd, name, type, false))
+      walk.push(task.dir + entry.data() + "/", task.segment, true); });
+  close(fd);
+}
+
+static void glob_worker(GlobWalk &walk, GlobMatches &out)
+{
+  unique_lock<mutex> guard(walk.lock);
+  while (true)
+  {
+    walk.ready.wait(guard, [&]
+                    { return !walk.queue.empty() || walk.busy == 0; });
+    if (walk.queue.empty())
+      break;
+    GlobWalk::Task task = move(walk.queue.back());
+    walk.queue.pop_back();
+    walk.busy++;
+    guard.unlock();
+    glob_visit(walk, out, task);
+    guard.lock();
+    walk.busy--;
+    if (walk.busy == 0 && walk.queue.empty())
+      walk.ready.notify_all();
+  }
+}
+
+// Runs the walk and gathers the sorted matches into one buffer of
+// NUL-terminated paths, the only copy made of them.
+static void glob_walk(const GlobPattern &glob, vector<char> &buffer, vector<string_view> &paths)
+{
+  GlobWalk walk(glob);
+  walk.queue.push_back({glob.root, 0});
+  size_t threads = 1;
+  if (glob.has_globstar)
+    threads = clamp<size_t>(thread::hardware_concurrency(), 1, 8);
+  vector<GlobMatches> matches(threads);
+  vector<thread> pool;
+  for (size_t t = 1; t < threads; t++)
+  {
+    pool.emplace_back(glob_worker, ref(walk), ref(matches[t]));
+  }
+  glob_worker(walk, matches[0]);
+  for (auto &t : pool)
+  {
+    t.join();
+  }
+
+  vector<string_view> found;
+  size_t bytes = 0;
+  for (const auto &m : matches)
+  {
+    for (const auto &p : m.paths)
+    {
+      found.emplace_back(m.arena.data() + p.first, p.second);
+    }
+    bytes += m.arena.size();
+  }
+  sort(found.begin(), found.end());
+  buffer.resize(bytes);
+  char *out = buffer.data();
+  paths.reserve(paths.size() + found.size());
+  for (string_view path : found)
+  {
+    memcpy(out, path.data(), path.size() + 1);
+    paths.emplace_back(out, path.size());
+    out += path.size() + 1;
+  }
+}
+
+static string glob_unescape(string_view pattern)
+{
+  string out;
+  for (size_t i = 0; i < pattern.size(); i++)
+  {
+    if (pattern[i] == '\\' && i + 1 < pattern.size())
+      i++;
+    out.push_back(pattern[i]);
+  }
+  return out;
+}
+
+// Appends the expansion of pattern to words: its matches, or the pattern
+// itself with its escapes removed if there are none.
+static void expand_glob_word(string_view pattern, vector<string_view> &words, deque<vector<char>> &storage)
+{
+  TraceScope trace("glob", pattern);
+  GlobPattern glob = compile_glob(pattern);
+  storage.emplace_back();
+  size_t before = words.size();
+  if (!glob.segments.empty())
+    glob_walk(glob, storage.back(), words);
+  if (words.size() > before)
+    return;
+  string literal = glob_unescape(pattern);
+  storage.back().assign(literal.c_str(), literal.c_str() + literal.size() + 1);
+  words.emplace_back(storage.back().data(), literal.size());
+}
+
+const Pipeline &expand_globs(const Pipeline &pipeline, Pipeline &expanded, deque<vector<char>> &storage)
+{
+  bool any = any_of(pipeline.stages.begin(), pipeline.stages.end(), [](const SimpleCommand &c)
+                    { return !c.globs.empty() || any_of(c.redirs.begin(), c.redirs.end(), [](const Redirection &r)
+                                                          { return r.glob; }); });
+  if (!any)
+    return pipeline;
+  expanded.timed = pipeline.timed;
+  expanded.stages.clear();
+  for (const auto &stage : pipeline.stages)
+  {
+    SimpleCommand command;
+    size_t next_glob = 0;
+    for (size_t i = 0; i < stage.words.size(); i++)
+    {
+      if (next_glob < stage.globs.size() && stage.globs[next_glob] == i)
+      {
+        next_glob++;
+        expand_glob_word(stage.words[i], command.words, storage);
+      }
+      else
+        command.words.push_back(stage.words[i]);
+    }
+    // A redirection target takes its single match, or stays literal.
+    for (Redirection redir : stage.redirs)
+    {
+      if (redir.glob)
+      {
+        vector<string_view> matches;
+        expand_glob_word(redir.file, matches, storage);
+        if (matches.size() > 1)
+        {
+          string literal = glob_unescape(redir.file);
+          storage.emplace_back(literal.c_str(), literal.c_str() + literal.size() + 1);
+          matches[0] = string_view(storage.back().data(), literal.size());
+        }
+        redir.file = matches[0];
+        redir.glob = false;
+      }
+      command.redirs.push_back(redir);
+    }
+    expanded.stages.push_back(move(command));
+  }
+  return expanded;
+}
+
+vector<string> glob_paths(string_view pattern)
+{
+  deque<vector<char>> storage;
+  vector<string_view> words;
+  expand_glob_word(pattern, words, storage);
+  return vector<string>(words.begin(), words.end());
+}
+
+// Single-pass lexer. Word bytes, with quotes and escapes already removed and
+// parameters ($NAME, ${NAME}, $?, $$) expanded, are written once into `arena`,
+// each followed by a NUL, and word tokens are views into it. The arena is sized
+// for the worst case of the (first) line up front; only an expansion, or
+// commands after here-document bodies, can make it grow. Operators are only
+// recognized outside quotes, so '|' or "&&" stay ordinary words. A word with an
+// unquoted glob character is written as a pattern instead: its quoted or
+// escaped *, ?, [ and \ (and everything expanded into it) get a backslash.
+// Expanded values are not split into several words. At a newline the bodies of
+// the here-documents started so far are taken from the lines that follow, each
+// up to the line holding just its delimiter; the body replaces the delimiter
+// word as a view into `line`, so even a large one is never copied here.
+vector<Token> lex_command_line(string_view line, vector<char> &arena, vector<string> *open_heredocs)
+{
+  vector<Token> tokens;
+  size_t n = line.size();
+  arena.assign(min(line.find('\n'), n) * 2 + 1, '\0');
+  char *out = arena.data();
+  char *word_start = nullptr;
+  bool single_quote = false;
+  bool double_quote = false;
+  bool word_glob = false;
+  bool word_quoted = false;   // has quotes or escapes (matters for delimiters)
+  vector<size_t> quoted_meta; // offsets in the word of quoted glob characters
+  vector<size_t> heredocs;    // delimiter tokens still waiting for a body
+
+  auto begin_word = [&]()
+  {
+    if (!word_start)
+      word_start = out;
+  };
+  // Writes a character that came from quotes or an escape.
+  auto put_quoted = [&](char ch)
+  {
+    if (ch == '*' || ch == '?' || ch == '[' || ch == '\\')
+      quoted_meta.push_back(out - word_start);
+    *out++ = ch;
+  };
+  auto end_word = [&]()
+  {
+    if (!word_start)
+      return;
+    if (word_glob && !quoted_meta.empty())
+    {
+      // Escape the quoted glob characters, moving the word right in place.
+      size_t k = quoted_meta.size();
+      for (char *p = out - 1; k > 0; p--)
+      {
+        p[k] = *p;
+        if ((size_t)(p - word_start) == quoted_meta[k - 1])
+          p[--k] = '\\';
+      }
+      out += quoted_meta.size();
+    }
+    tokens.push_back({TokenKind::Word, string_view(word_start, out - word_start)});
+    tokens.back().glob = word_glob;
+    size_t k = tokens.size();
+    if (k >= 2 && tokens[k - 2].kind == TokenKind::Redirect && tokens[k - 2].here != HereKind::None)
+    {
+      tokens.back().glob = false;
+      if (tokens[k - 2].here == HereKind::Document)
+      {
+        if (word_quoted)
+          tokens[k - 2].here = HereKind::LiteralDocument;
+        heredocs.push_back(k - 1);
+      }
+    }
+    *out++ = '\0';
+    word_start = nullptr;
+    word_glob = false;
+    word_quoted = false;
+    quoted_meta.clear();
+  };
+  auto op = [&](TokenKind kind, size_t at, size_t len)
+  {
+    end_word();
+    tokens.push_back({kind, line.substr(at, len)});
+  };
+  // Makes room for `more` expanded bytes while keeping the worst case of the
+  // `rest` of the line; a new arena takes the views made so far along.
+  auto grow = [&](size_t more, size_t rest)
+  {
+    size_t used = out - arena.data();
+    size_t need = used + 2 * (more + rest) + 1;
+    if (need <= arena.size())
+      return;
+    vector<char> bigger(max(need, arena.size() * 2), '\0');
+    memcpy(bigger.data(), arena.data(), used);
+    for (auto &t : tokens)
+    {
+      // Here-document bodies point into the line, not the arena.
+      bool in_arena = t.text.data() >= arena.data() && t.text.data() < arena.data() + arena.size();
+      if (t.kind == TokenKind::Word && in_arena)
+        t.text = string_view(bigger.data() + (t.text.data() - arena.data()), t.text.size());
+    }
+    if (word_start)
+      word_start = bigger.data() + (word_start - arena.data());
+    out = bigger.data() + used;
+    arena.swap(bigger);
+  };
+  // Writes the value of the parameter whose '$' is at line[i] and leaves i on
+  // its last character; false if no parameter starts there. An empty value
+  // outside quotes makes no word.
+  auto expand = [&](size_t &i) -> bool
+  {
+    string number;
+    const char *value;
+    if (!read_parameter(line, i, number, value))
+      return false;
+    size_t len = value ? strlen(value) : 0;
+    if (len == 0)
+      return true;
+    grow(len, min(line.find('\n', i), n) - i);
+    begin_word();
+    for (size_t k = 0; k < len; k++)
+    {
+      put_quoted(value[k]);
+    }
+    return true;
+  };
+
+  for (size_t i = 0; i < n; ++i)
+  {
+    char ch = line[i];
+    if (single_quote)
+    {
+      if (ch == '\'')
+        single_quote = false;
+      else
+        put_quoted(ch);
+      continue;
+    }
+    if (double_quote)
+    {
+      if (ch == '"')
+        double_quote = false;
+      else if (ch == '\\' && i + 1 < n && (line[i + 1] == '"' || line[i + 1] == '\\' || line[i + 1] == '$'))
+        put_quoted(line[++i]);
+      else if (ch != '$' || !expand(i))
+        put_quoted(ch);
+      continue;
+    }
+    switch (ch)
+    {
+    case '\\':
+      begin_word();
+      word_quoted = true;
+      put_quoted(i + 1 < n ? line[++i] : '\\');
+      break;
+    case '*':
+    case '?':
+    case '[':
+      begin_word();
+      word_glob = true;
+      *out++ = ch;
+      break;
+    case '$':
+      if (!expand(i))
+      {
+        begin_word();
+        *out++ = ch;
+      }
+      break;
+    case '\'':
+      begin_word();
+      single_quote = true;
+      word_quoted = true;
+      break;
+    case '"':
+      begin_word();
+      double_quote = true;
+      word_quoted = true;
+      break;
+    case ' ':
+    case '\t':
+      end_word();
+      break;
+    case '|':
+      if (i + 1 < n && line[i + 1] == '|')
+        op(TokenKind::Or, i++, 2);
+      else
+        op(TokenKind::Pipe, i, 1);
+      break;
+    case ';':
+      op(TokenKind::Semi, i, 1);
+      break;
+    case '&':
+      if (i + 1 < n && line[i + 1] == '&')
+      {
+        op(TokenKind::And, i++, 2);
+        break;
+      }
+      op(TokenKind::Background, i, 1);
+      break;
+    case '1':
+    case '2':
+    case '>':
+    {
+      // "1>" and "2>" only count as operators at the start of a word.
+      size_t at = i;
+      int fd = STDOUT_FILENO;
+      if (ch != '>')
+      {
+        if (word_start || i + 1 >= n || line[i + 1] != '>')
+        {
+          begin_word();
+          *out++ = ch;
+          break;
+        }
+        fd = ch - '0';
+        i++;
+      }
+      bool append = i + 1 < n && line[i + 1] == '>';
+      if (append)
+        i++;
+      // ">&" duplicates a descriptor; that '&' never ends the command.
+      bool dup = !append && i + 1 < n && line[i + 1] == '&';
+      if (dup)
+        i++;
+      op(TokenKind::Redirect, at, i - at + 1);
+      tokens.back().fd = fd;
+      tokens.back().append = append;
+      tokens.back().dup = dup;
+      break;
+    }
+    case '<':
+    {
+      size_t at = i;
+      HereKind here = HereKind::None;
+      if (i + 2 < n && line[i + 1] == '<' && line[i + 2] == '<')
+      {
+        here = HereKind::String;
+        i += 2;
+      }
+      else if (i + 1 < n && line[i + 1] == '<')
+      {
+        here = HereKind::Document;
+        i++;
+      }
+      bool dup = here == HereKind::None && i + 1 < n && line[i + 1] == '&';
+      if (dup)
+        i++;
+      op(TokenKind::Redirect, at, i - at + 1);
+      tokens.back().fd = STDIN_FILENO;
+      tokens.back().here = here;
+      tokens.back().dup = dup;
+      break;
+    }
+    case '\n':
+    {
+      end_word();
+      size_t at = i;
+      size_t pos = i + 1;
+      for (size_t t : heredocs)
+      {
+        // The delimiter line is found with memmem on "\n<delimiter>", so
+        // the body's lines are never walked one by one.
+        string needle = "\n" + string(tokens[t].text);
+        size_t body = pos;
+        size_t end = string_view::npos;
+        for (size_t at = pos - 1; end == string_view::npos && at < n;)
+        {
+          const char *hit = (const char *)memmem(line.data() + at, n - at, needle.data(), needle.size());
+          if (!hit)
+            break;
+          size_t after = hit - line.data() + needle.size();
+          if (after == n || line[after] == '\n')
+          {
+            end = hit - line.data() + 1;
+            pos = min(after + 1, n);
+          }
+          at = hit - line.data() + 1;
+        }
+        if (end == string_view::npos)
+        {
+          end = n;
+          pos = n;
+          if (open_heredocs)
+            open_heredocs->emplace_back(tokens[t].text);
+        }
+        tokens[t].text = line.substr(body, end - body);
+      }
+      heredocs.clear();
+      grow(0, n - pos);
+      i = pos - 1;
+      // Anything after the bodies is another command.
+      if (pos < n && !tokens.empty() && tokens.back().kind == TokenKind::Word)
+        op(TokenKind::Semi, at, 1);
+      break;
+    }
+    default:
+      begin_word();
+      *out++ = ch;
+    }
+  }
+  if (single_quote || double_quote)
+    begin_word();
+  end_word();
+  // Here-documents with no body lines at all.
+  for (size_t t : heredocs)
+  {
+    if (open_heredocs)
+      open_heredocs->emplace_back(tokens[t].text);
+    tokens[t].text = line.substr(n);
+  }
+  return tokens;
+}
+
+vector<string> heredoc_delimiters(string_view line)
+{
+  vector<string> delimiters;
+  if (line.find("<<") == string_view::npos)
+    return delimiters;
+  vector<char> arena;
+  lex_command_line(line, arena, &delimiters);
+  return delimiters;
+}
+
+// Builds the command AST: list := pipeline ((";" | "&" | "&&" | "||") pipeline)*,
+// pipeline := ["time"] command ("|" command)*, command := (word | redirect word)+.
+// On a syntax error returns nullopt with a message in error.
+optional<CommandList> parse_tokens(const vector<Token> &tokens, string &error)
+{
+  CommandList list;
+  size_t i = 0;
+  auto unexpected = [&](size_t at)
+  {
+    error = "syntax error near unexpected token `" + (at < tokens.size() ? string(tokens[at].text) : string("newline")) + "'";
+    return nullopt;
+  };
+  while (i < tokens.size())
+  {
+    Pipeline pipeline;
+    if (tokens[i].kind == TokenKind::Word && tokens[i].text == "time")
+    {
+      pipeline.timed = true;
+      i++;
+    }
+    while (true)
+    {
+      SimpleCommand command;
+      while (i < tokens.size() && (tokens[i].kind == TokenKind::Word || tokens[i].kind == TokenKind::Redirect))
+      {
+        if (tokens[i].kind == TokenKind::Word)
+        {
+          if (tokens[i].glob)
+            command.globs.push_back(command.words.size());
+          command.words.push_back(tokens[i++].text);
+          continue;
+        }
+        if (i + 1 >= tokens.size() || tokens[i + 1].kind != TokenKind::Word)
+          return unexpected(i + 1);
+        string_view target = tokens[i + 1].text;
+        if (tokens[i].dup && (target.empty() || target.size() > 9 || !all_of(target.begin(), target.end(), ::isdigit)))
+        {
+          error = string(target) + ": ambiguous redirect";
+          return nullopt;
+        }
+        command.redirs.push_back({tokens[i].fd, target, tokens[i].append, tokens[i + 1].glob, tokens[i].here, tokens[i].dup});
+        i += 2;
+      }
+      if (command.words.empty())
+        return unexpected(i);
+      pipeline.stages.push_back(move(command));
+      if (i < tokens.size() && tokens[i].kind == TokenKind::Pipe)
+      {
+        i++;
+        continue;
+      }
+      break;
+    }
+    list.pipelines.push_back(move(pipeline));
+    list.background.push_back(i < tokens.size() && tokens[i].kind == TokenKind::Background);
+    if (i >= tokens.size())
+      break;
+    TokenKind kind = tokens[i].kind;
+    if ((kind == TokenKind::Semi || kind == TokenKind::Background) && i + 1 == tokens.size())
+      break;
+    list.ops.push_back(kind == TokenKind::And ? ListOp::And : kind == TokenKind::Or ? ListOp::Or
+                                                                                    : ListOp::Seq);
+    list.separators.push_back(tokens[i].text);
+    i++;
+    if (i >= tokens.size())
+      return unexpected(i);
+  }
+  return list;
+}
+
+optional<CommandList> parse_command_line(string_view line, vector<char> &arena, string &error)
+{
+  return parse_tokens(lex_command_line(line, arena), error);
+}
+
+// Runs a pipeline of one command in the shell itself, so builtins like cd
+// affect the shell.
+int run_simple_command(const SimpleCommand &command)
+{
+  string command_i(command.words[0]);
+  if (command_i == "cache")
+    return run_cached(command);
+  if (is_builtin(command_i))
+  {
+    OutputPlan plan = plan_outputs(command.redirs, -1);
+    if (plan.failed)
+    {
+      close_fds(plan.owned);
+      join_pumps(plan);
+      return 1;
+    }
+    vector<pair<int, int>> saved;
+    for (const auto &fd : plan.fds)
+    {
+      saved.emplace_back(dup(fd.second), fd.second);
+      dup2(fd.first, fd.second);
+    }
+    int status;
+    {
+      FdStreamBuf buf(STDOUT_FILENO);
+      ostream out(&buf);
+      status = run_builtin(command_i, builtin_args(command), out);
+    }
+    for (const auto &fd : saved)
+    {
+      dup2(fd.first, fd.second);
+      close(fd.first);
+    }
+    close_fds(plan.owned);
+    join_pumps(plan);
+    return status;
+  }
+  auto program_path = find_in_path(command_i);
+  if (!program_path.has_value())
+  {
+    cout << command_i << ": command not found\n";
+    return 127;
+  }
+  return execute_external(program_path.value(), command.words, command.redirs);
+}
+
+// Runs one pipeline of a list; sets `exited` when it ran `exit`.
+static int dispatch_pipeline(const Pipeline &pipeline, bool background, int &exit_code, bool &exited)
+{
+  if (background)
+    return handle_pipeline_n(pipeline, true);
+  if (pipeline.stages.size() > 1 || runs_in_shell(pipeline.stages[0]))
+    return handle_pipeline_n(pipeline);
+  const SimpleCommand &command = pipeline.stages[0];
+  if (pipeline.timed)
+  {
+    if (!is_builtin(string(command.words[0])))
+      return handle_pipeline_n(pipeline);
+    double started = monotonic_seconds();
+    struct rusage before;
+    getrusage(RUSAGE_THREAD, &before);
+    int status = run_simple_command(command);
+    StageUsage usage = thread_usage_since(before, started);
+    usage.command = job_text(pipeline);
+    report_time(usage.real, {usage});
+    return status;
+  }
+  if (command.words[0] == "exit")
+  {
+    optional<int> code = exit_status(builtin_args(command), cerr);
+    if (!code)
+      return 2;
+    exit_code = *code;
+    exited = true;
+    return exit_code;
+  }
+  return run_simple_command(command);
+}
+
+// A command made only of NAME=value words sets shell variables. As the
+// prefix of a command they are exported to that command alone (in a
+// pipeline, to the whole pipeline while it starts).
+static int run_pipeline(const Pipeline &pipeline, bool background, int &exit_code, bool &exited)
+{
+  const SimpleCommand &first = pipeline.stages[0];
+  if (pipeline.stages.size() == 1 && all_of(first.words.begin(), first.words.end(), is_assignment))
+  {
+    for (string_view word : first.words)
+    {
+      size_t eq = word.find('=');
+      set_variable(word.substr(0, eq), word.substr(eq + 1));
+    }
+    return 0;
+  }
+  if (none_of(pipeline.stages.begin(), pipeline.stages.end(), [](const SimpleCommand &c)
+              { return is_assignment(c.words[0]); }))
+    return dispatch_pipeline(pipeline, background, exit_code, exited);
+
+  Pipeline stripped = pipeline;
+  vector<Variable> saved;
+  for (auto &stage : stripped.stages)
+  {
+    size_t n = 0;
+    while (n + 1 < stage.words.size() && is_assignment(stage.words[n]))
+    {
+      string_view word = stage.words[n++];
+      size_t eq = word.find('=');
+      saved.push_back(intern_variable(word.substr(0, eq)));
+      set_variable(word.substr(0, eq), word.substr(eq + 1), true);
+    }
+    stage.words.erase(stage.words.begin(), stage.words.begin() + n);
+  }
+  int status = dispatch_pipeline(stripped, background, exit_code, exited);
+  for (auto it = saved.rbegin(); it != saved.rend(); ++it)
+  {
+    Variable &v = intern_variable(string_view(it->entry).substr(0, it->name_len));
+    v.entry = it->entry;
+    v.set = it->set;
+    v.exported = it->exported;
+    v.version = ++variable_changes;
+  }
+  envp_stale = true;
+  return status;
+}
+
+// Runs one input line. Returns false when the line ran `exit`, with the
+// requested status in exit_code.
+bool execute_line(const string &line, int &exit_code)
+{
+  TraceScope trace("line", line);
+  hash_epoch++;
+  if (!job_control)
+    notify_jobs(false);
+  vector<char> arena;
+  string error;
+  optional<CommandList> list;
+  {
+    TraceScope parse_trace("parse");
+    list = parse_command_line(line, arena, error);
+  }
+  if (!list)
+  {
+    cerr << error << "\n";
+    return true;
+  }
+  // Globs are expanded just before their pipeline runs, so they see files
+  // made by earlier ones.
+  deque<vector<char>> glob_storage;
+  string_view text = line; // what `list` was lexed from
+  string text_storage;
+  int status = 0;
+  ListOp join = ListOp::Seq; // joins pipelines[i] to the one before
+  for (size_t i = 0; i < list->pipelines.size();)
+  {
+    if ((join == ListOp::And && status != 0) || (join == ListOp::Or && status == 0))
+    {
+      if (i < list->ops.size())
+        join = list->ops[i];
+      i++;
+      continue;
+    }
+    Pipeline expanded;
+    bool exited = false;
+    status = run_pipeline(expand_globs(list->pipelines[i], expanded, glob_storage), list->background[i], exit_code,
+                          exited);
+    if (exited)
+      return false;
+    last_status = status;
+    if (i >= list->ops.size())
+      break;
+    join = list->ops[i];
+    // Parameters were expanded when the line was lexed; if the rest of the
+    // line uses any, lex it again so it sees what this pipeline changed.
+    // Here-document bodies after the first line are expanded as they are
+    // delivered, so only the commands count, and the bodies of the pipelines
+    // that already ran are left out.
+    string_view separator = list->separators[i];
+    size_t from = separator.data() + separator.size() - text.data();
+    size_t first_nl = min(text.find('\n', from), text.size());
+    if (text.substr(from, first_nl - from).find('$') == string_view::npos)
+    {
+      i++;
+      continue;
+    }
+    size_t bodies = min(first_nl + 1, text.size());
+    for (size_t k = 0; k <= i; k++)
+    {
+      for (const auto &stage : list->pipelines[k].stages)
+      {
+        for (const auto &r : stage.redirs)
+        {
+          if (r.here != HereKind::Document && r.here != HereKind::LiteralDocument)
+            continue;
+          size_t delimiter = min(text.find('\n', r.file.data() + r.file.size() - text.data()), text.size());
+          bodies = max(bodies, min(delimiter + 1, text.size()));
+        }
+      }
+    }
+    string rest(text.substr(from, first_nl - from));
+    if (bodies < text.size())
+      rest.append("\n").append(text.substr(bodies));
+    text_storage = move(rest);
+    text = text_storage;
+    list = parse_command_line(text, arena, error);
+    if (!list)
+    {
+      cerr << error << "\n";
+      return true;
+    }
+    i = 0;
+  }
+  return true;
+}
+
+// Non-interactive input loop for scripts, -c strings and piped stdin: no
+// readline, no prompt, no history. Input is read in large chunks and split
+// into lines in place. When the input is the shell's own stdin and seekable,
+// the offset is put back after each line so commands that read stdin see the
+// rest of the file, as they would under other shells.
+int run_batch(int fd)
+{
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  bool share_input = fd == STDIN_FILENO && pos != -1;
+  vector<char> buf(1 << 16);
+  string pending;
+  int exit_code = 0;
+  bool eof = false;
+  string line;
+  vector<string> delimiters; // here-document bodies still being collected
+  size_t next_delimiter = 0;
+  while (!eof)
+  {
+    ssize_t got = read(fd, buf.data(), buf.size());
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+    {
+      eof = true;
+      if (pending.empty())
+        break;
+      pending.push_back('\n');
+    }
+    else
+    {
+      pending.append(buf.data(), got);
+    }
+    size_t start = 0;
+    size_t nl;
+    while ((nl = pending.find('\n', start)) != string::npos)
+    {
+      string_view next(pending.data() + start, nl - start);
+      start = nl + 1;
+      if (next_delimiter < delimiters.size())
+      {
+        line.append("\n").append(next);
+        if (next == delimiters[next_delimiter])
+          next_delimiter++;
+        if (next_delimiter < delimiters.size())
+          continue;
+      }
+      else
+      {
+        line.assign(next);
+        delimiters = heredoc_delimiters(line);
+        next_delimiter = 0;
+        if (!delimiters.empty())
+          continue;
+      }
+      if (share_input)
+      {
+        pos += start;
+        lseek(fd, pos, SEEK_SET);
+        pending.clear();
+        start = 0;
+      }
+      if (!execute_line(line, exit_code))
+        return exit_code;
+      if (share_input)
+      {
+        pos = lseek(fd, 0, SEEK_CUR);
+        break;
+      }
+    }
+    if (share_input)
+      pos += start;
+    pending.erase(0, start);
+  }
+  // Input ended inside a here-document.
+  if (next_delimiter < delimiters.size())
+    execute_line(line, exit_code);
+  return exit_code;
+}
+
+void shell_init()
+{
+  rl_attempted_completion_function = completion;
+  rl_completion_append_character = ' ';
+  rl_completer_word_break_characters = completion_word_breaks;
+  rl_completer_quote_characters = "'\"";
+  rl_char_is_quoted_p = completion_char_is_quoted;
+  cout << unitbuf;
+  cerr << unitbuf;
+  signal(SIGPIPE, SIG_IGN);
+  import_environment();
+  trace_open();
+
+  // Block SIGCHLD before any helper thread exists so it is only ever seen
+  // through the signalfd.
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, nullptr);
+  sigchld_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  // Forked now, while the shell is still small and has no threads.
+  const char *helper = variable_value("SHELL_SPAWN_HELPER");
+  if (helper && string(helper) == "1" && start_spawn_helper())
+    use_spawn_helper(true);
+}
+
+void shell_init_interactive()
+{
+  job_control = true;
+  signal(SIGTSTP, SIG_IGN);
+  signal(SIGTTIN, SIG_IGN);
+  signal(SIGTTOU, SIG_IGN);
+  setpgid(0, 0);
+  shell_pgid = getpgrp();
+  tcsetpgrp(STDIN_FILENO, shell_pgid);
+  rl_getc_function = job_getc;
+  rl_bind_key('R' & 0x1f, history_search_widget);
+  index_start_worker();
+}
+
+void load_history_file()
+{
+  stifle_history(HISTORY_RECALL);
+  const char *histfile = variable_value("HISTFILE");
+  if (!histfile || !*histfile)
+    return;
+  hist.log_fd = open(histfile, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (hist.log_fd < 0)
+  {
+    perror("HISTFILE");
+    return;
+  }
+  struct stat st;
+  if (fstat(hist.log_fd, &st) != 0 || st.st_size == 0)
+    return;
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, hist.log_fd, 0);
+  if (map == MAP_FAILED)
+  {
+    perror("HISTFILE");
+    return;
+  }
+  hist.map = (const char *)map;
+  hist.map_len = st.st_size;
+  madvise(map, st.st_size, MADV_RANDOM);
+  // Terminate a last line written by something else, so appends start on a
+  // line of their own.
+  if (hist.map[hist.map_len - 1] != '\n')
+    write_all(hist.log_fd, "\n", 1);
+
+  // Seed readline with the newest lines, found by scanning back from the end.
+  vector<string_view> recent;
+  const char *end = hist.map + hist.map_len;
+  while (end > hist.map && (int)recent.size() < HISTORY_RECALL)
+  {
+    const char *line_end = end;
+    if (line_end[-1] == '\n')
+      line_end--;
+    const char *nl = (const char *)memrchr(hist.map, '\n', line_end - hist.map);
+    const char *start = nl ? nl + 1 : hist.map;
+    if (line_end > start)
+      recent.emplace_back(start, line_end - start);
+    end = start;
+  }
+  for (auto it = recent.rbegin(); it != recent.rend(); ++it)
+  {
+    add_history(string(*it).c_str());
+  }
+}
@@ -0,0 +1,198 @@
+#ifndef SHELL_H
+#define SHELL_H
+
+// Core of the shell, shared by the interactive binary (main.cpp) and the
+// benchmark suite (bench/bench.cpp).
+
+#include <deque>
+#include <iosfwd>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+// ---- Parsing -------------------------------------------------------------
+
+// Command AST built by parse_command_line. Words and redirection targets are
+// views into the lexer's arena and are NUL-terminated there. A word with an
+// unquoted *, ? or [ is a glob pattern, kept with its quoted characters
+// backslash-escaped until expand_globs replaces it with the matching paths.
+//
+// Input redirections have fd 0. For a duplication ("2>&1", "<&3"), `file` is
+// the descriptor it copies. For a here-document or here-string, `file`
+// is the text itself: a here-document's body is a view into the input line
+// (not NUL-terminated), and its parameters are expanded when it is delivered
+// unless the delimiter was quoted.
+enum class HereKind
+{
+  None,
+  String,         // <<< word: the word, delivered with a newline
+  Document,       // << word
+  LiteralDocument // << 'word'
+};
+
+struct Redirection
+{
+  int fd;
+  std::string_view file;
+  bool append;
+  bool glob = false;
+  HereKind here = HereKind::None;
+  bool dup = false; // N>&M, N<&M
+};
+
+struct SimpleCommand
+{
+  std::vector<std::string_view> words;
+  std::vector<Redirection> redirs;
+  std::vector<size_t> globs; // indices of the words that are glob patterns
+};
+
+struct Pipeline
+{
+  std::vector<SimpleCommand> stages;
+  bool timed = false; // prefixed with the `time` keyword
+};
+
+enum class ListOp
+{
+  Seq,
+  And,
+  Or
+};
+
+// pipelines[i] and pipelines[i + 1] are joined by ops[i], spelled
+// separators[i] in the input line; background[i] is set when pipelines[i]
+// was terminated by "&".
+struct CommandList
+{
+  std::vector<Pipeline> pipelines;
+  std::vector<ListOp> ops;
+  std::vector<std::string_view> separators;
+  std::vector<bool> background;
+};
+
+enum class TokenKind
+{
+  Word,
+  Pipe,
+  And,
+  Or,
+  Semi,
+  Background,
+  Redirect
+};
+
+struct Token
+{
+  TokenKind kind;
+  std::string_view text; // word text, or the operator's spelling
+  int fd = -1;           // redirections: the descriptor being redirected
+  bool append = false;
+  bool dup = false; // redirections: ">&" or "<&", followed by a descriptor
+  bool glob = false; // words: a glob pattern (see SimpleCommand)
+  HereKind here = HereKind::None;
+};
+
+// Lines after the first hold the bodies of the first line's here-documents.
+// open_heredocs, when given, receives the delimiters whose line is missing.
+std::vector<Token> lex_command_line(std::string_view line, std::vector<char> &arena,
+                                    std::vector<std::string> *open_heredocs = nullptr);
+std::optional<CommandList> parse_tokens(const std::vector<Token> &tokens, std::string &error);
+std::optional<CommandList> parse_command_line(std::string_view line, std::vector<char> &arena, std::string &error);
+// Delimiters of the here-documents a command line starts, in the order their
+// bodies must follow it; callers append body lines up to each delimiter line
+// before running the line.
+std::vector<std::string> heredoc_delimiters(std::string_view line);
+
+// Pathname expansion. Returns pipeline itself when no word is a glob pattern,
+// otherwise a copy in `expanded` whose patterns are replaced by their matches
+// in sorted order (or by the unescaped pattern if nothing matches). Matched
+// paths live in `storage`, which must outlive the copy.
+const Pipeline &expand_globs(const Pipeline &pipeline, Pipeline &expanded, std::deque<std::vector<char>> &storage);
+std::vector<std::string> glob_paths(std::string_view pattern);
+
+// ---- Variables -----------------------------------------------------------
+
+// Shell variables, imported from the environment at startup; exported ones
+// make up the environment of spawned commands. variable_value returns
+// nullptr for an unset variable.
+const char *variable_value(std::string_view name);
+void set_variable(std::string_view name, std::string_view value, bool exported = false);
+void unset_variable(std::string_view name);
+bool is_assignment(std::string_view word);
+
+// ---- Command lookup and completion ----------------------------------------
+
+std::vector<std::string> split_path(const std::string &path_env);
+std::optional<std::string> find_in_path(const std::string &cmd, bool count_hit = true);
+void hash_reset();
+
+std::vector<std::string> completion_matches(const std::string &prefix);
+std::vector<std::string> filename_matches(const std::string &word, bool dirs_only = false,
+                                          bool quoted = false);
+char **completion(const char *text, int start, int end);
+
+// ---- Execution -----------------------------------------------------------
+
+bool is_builtin(const std::string &cmd);
+// Returns the builtin's exit status.
+int run_builtin(const std::string &cmd, const std::vector<std::string> &args, std::ostream &out, bool subshell = false);
+pid_t spawn_command(const std::string &path, const std::vector<std::string_view> &argv,
+                    const std::vector<std::pair<int, int>> &fds, pid_t pgid = -1);
+// Pre-forked spawn helper: start_spawn_helper forks it (shell_init does so
+// when SHELL_SPAWN_HELPER=1); while in use, spawn_command sends it requests.
+bool start_spawn_helper();
+void use_spawn_helper(bool on);
+int handle_pipeline_n(const Pipeline &pipeline, bool background = false);
+int execute_external(const std::string &path, const std::vector<std::string_view> &argv, const std::vector<Redirection> &redirs);
+int run_cached(const SimpleCommand &command);
+bool execute_line(const std::string &line, int &exit_code);
+int run_batch(int fd);
+
+// ---- Session -------------------------------------------------------------
+
+void shell_init();
+void shell_init_interactive();
+void load_history_file();
+void history_append(const std::string &line);
+void notify_jobs(bool report);
+
+// ---- Tracing -------------------------------------------------------------
+
+// Opt-in latency tracing. When SHELL_TRACE names a file at startup, every
+// TraceScope writes a Chrome trace-event ("X" complete event) to it, viewable
+// in chrome://tracing or Perfetto. With tracing off a scope costs one branch.
+extern bool trace_enabled;
+
+class TraceScope
+{
+public:
+  TraceScope(const char *name, std::string_view detail = {})
+  {
+    if (trace_enabled)
+      begin(name, detail);
+  }
+
+  ~TraceScope()
+  {
+    if (active)
+      finish();
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+  void begin(const char *name, std::string_view detail);
+  void finish();
+
+  bool active = false;
+  const char *name = nullptr;
+  std::string detail;
+  double start = 0;
+};
+
+#endif
@@ -0,0 +1,200 @@
+// Behaviour tests for the shell core. Each case runs command lines through
+// execute_line, as the shell does for its input, and checks the variables
+// and files they leave behind.
+//
+//   shell_test             run every case; exits non-zero if any check fails
+
+#include <bits/stdc++.h>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../shell.h"
+using namespace std;
+
+static filesystem::path fixture_root;
+static int failures = 0;
+
+// Runs one command line; returns false if it ran `exit`.
+static bool run(const string &line)
+{
+  int exit_code = 0;
+  return execute_line(line, exit_code);
+}
+
+static string value(const string &name)
+{
+  const char *v = variable_value(name);
+  return v ? v : "<unset>";
+}
+
+static void check(bool ok, const string &what)
+{
+  if (!ok)
+  {
+    cerr << "FAIL: " << what << "\n";
+    failures++;
+  }
+}
+
+static void check_value(const string &name, const string &expected, const string &what)
+{
+  string got = value(name);
+  check(got == expected, what + " (" + name + " = " + got + ", expected " + expected + ")");
+}
+
+// Builtins report failure through their exit status, so && and || and $?
+// see it.
+static void test_builtin_status()
+{
+  string missing = (fixture_root / "missing").string();
+  run("unset R; cd " + missing + " && R=wrong");
+  check_value("R", "<unset>", "cd to a missing directory fails");
+  run("cd " + missing + "; S=$?");
+  check_value("S", "1", "cd status");
+  run("unset R; type nosuchcmd_xyz || R=fail");
+  check_value("R", "fail", "type of an unknown command fails");
+  run("type echo; S=$?");
+  check_value("S", "0", "type of a builtin");
+  run("unset R; export 1bad || R=fail");
+  check_value("R", "fail", "export of an invalid name fails");
+  run("echo x | exit 3; S=$?");
+  check_value("S", "3", "exit as the last pipeline stage");
+  run("unset R; fg || R=fail");
+  check_value("R", "fail", "fg without a job fails");
+  check(run("exit foo"), "exit with a non-numeric argument does not exit");
+  run("S=$?");
+  check_value("S", "2", "exit with a non-numeric argument");
+}
+
+static string read_file(const filesystem::path &path)
+{
+  ifstream in(path);
+  return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+// "N>&M" is a redirection, not a background job, and follows the order of
+// the redirections.
+static void test_dup_redirection()
+{
+  string out = (fixture_root / "dup.out").string();
+  string err = (fixture_root / "dup.err").string();
+  string missing = (fixture_root / "missing").string();
+  run("echo hi 2>&1 > " + out + "; S=$?");
+  check_value("S", "0", "echo hi 2>&1 runs");
+  check(read_file(out) == "hi\n", "echo hi 2>&1 > file writes the file");
+  run("ls " + missing + " > " + out + " 2>&1");
+  check(read_file(out).find("missing") != string::npos, "> file 2>&1 sends stderr to the file");
+  run("ls " + missing + " 2> " + err + " 2>&1 > " + out);
+  check(read_file(out).empty(), "2>&1 > file leaves stderr where stdout was");
+  run("ls " + missing + " 2>&1 | cat > " + out);
+  check(read_file(out).find("missing") != string::npos, "2>&1 | sends stderr into the pipe");
+  run("unset R");
+  run("echo x 2>&foo || R=bad");
+  check_value("R", "<unset>", "a non-numeric descriptor is rejected before running");
+}
+
+// In-process filters honour the stage's stderr redirection.
+static void test_filter_stderr()
+{
+  string out = (fixture_root / "filter.out").string();
+  string err = (fixture_root / "filter.err").string();
+  string missing = (fixture_root / "missing").string();
+  run("cat " + missing + " 2> " + err + " | wc -l > " + out);
+  check(read_file(err).find("missing") != string::npos, "filter errors follow 2>");
+  check(read_file(out) == "0\n", "filter output after an error");
+  run("cat " + missing + " 2>&1 | wc -l > " + out);
+  check(read_file(out) == "1\n", "filter errors follow 2>&1 into the pipe");
+}
+
+// Without an index for the current PATH, lookups read the on-disk snapshot
+// for directories whose mtime still matches and probe the rest.
+static void test_lookup_snapshot()
+{
+  filesystem::path bin = fixture_root / "bin";
+  filesystem::create_directories(bin);
+  auto make_tool = [&](const string &name)
+  {
+    ofstream(bin / name) << "#!/bin/sh\n";
+    filesystem::permissions(bin / name, filesystem::perms::owner_all);
+  };
+  make_tool("snaptool");
+  string old_path = value("PATH");
+  set_variable("PATH", bin.string(), true);
+  completion_matches("snap"); // builds the index and saves the snapshot
+  check(filesystem::exists(fixture_root / "path-index"), "snapshot written");
+  set_variable("PATH", bin.string() + ":" + (fixture_root / "empty").string(), true);
+  run("unset R; type snaptool && R=found");
+  check_value("R", "found", "lookup through the snapshot");
+  make_tool("newtool");
+  run("unset R; type newtool && R=found");
+  check_value("R", "found", "lookup in a directory changed since the snapshot");
+  set_variable("PATH", old_path, true);
+}
+
+// A trailing "**" also matches zero directories.
+static void test_globstar()
+{
+  filesystem::path root = fixture_root / "glob";
+  filesystem::create_directories(root / "a/b/c");
+  ofstream(root / "a/f");
+  string a = (root / "a").string();
+  auto joined = [](const vector<string> &paths)
+  {
+    string text;
+    for (const auto &p : paths)
+    {
+      text += p + " ";
+    }
+    return text;
+  };
+  check(joined(glob_paths(a + "/**/")) == a + "/ " + a + "/b/ " + a + "/b/c/ ", "a/**/ includes a/");
+  check(joined(glob_paths(a + "/**")) == a + "/ " + a + "/b " + a + "/b/c " + a + "/f ", "a/** includes a/");
+  check(joined(glob_paths(a + "/**/c/")) == a + "/b/c/ ", "a/**/c/");
+}
+
+// A command with a stdin redirection that fails does not run, whatever
+// follows it.
+static void test_failed_input()
+{
+  string ok = (fixture_root / "input.ok").string();
+  string out = (fixture_root / "input.out").string();
+  string missing = (fixture_root / "missing").string();
+  ofstream(ok) << "text\n";
+  run("cat < " + missing + " < " + ok + " > " + out + "; S=$?");
+  check_value("S", "1", "< missing < ok fails");
+  check(read_file(out).empty(), "< missing < ok does not run the command");
+  run("cat < " + ok + " < " + ok + " > " + out + "; S=$?");
+  check_value("S", "0", "< ok < ok runs");
+  check(read_file(out) == "text\n", "< ok < ok reads the last one");
+}
+
+int main()
+{
+  shell_init();
+  // Commands' output goes to /dev/null; failures are reported on stderr.
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+
+  char tmpl[] = "/tmp/shell_test.XXXXXX";
+  if (!mkdtemp(tmpl))
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+  fixture_root = tmpl;
+  set_variable("SHELL_PATH_INDEX", (fixture_root / "path-index").string());
+
+  test_builtin_status();
+  test_dup_redirection();
+  test_filter_stderr();
+  test_lookup_snapshot();
+  test_globstar();
+  test_failed_input();
+
+  error_code e;
+  filesystem::remove_all(fixture_root, e);
+  if (failures)
+    cerr << failures << " check(s) failed\n";
+  return failures ? 1 : 0;
+}